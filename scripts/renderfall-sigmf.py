@@ -14,7 +14,8 @@ def get_sigmf_paths(path):
 class SigMFFormat(object):
     def __init__(self, s):
         self.complex = s[0] == 'c'
-        base, self.endianness = s[1:].split('_')
+        # 8-bit types have no endianness suffix.
+        base, _, self.endianness = s[1:].partition('_')
         self.basetype = base[0]
         self.precision = int(base[1:])
 
@@ -29,14 +30,13 @@ class SigMFFormat(object):
     def renderfall_format(self):
         assert self.complex, \
             "Only complex supported for now, sorry"
-        assert self.endianness == 'le', \
-            "Only little-endian supported for now, sorry"
         name = {
             'u': 'uint',
             'i': 'int',
             'f': 'float',
         }[self.basetype]
-        return "%s%d" % (name, self.precision)
+        suffix = 'be' if self.endianness == 'be' and self.precision > 8 else ''
+        return "%s%d%s" % (name, self.precision, suffix)
 
 
 svg_preamble = '<?xml version="1.0" encoding="utf-8" standalone="no"?>'
@@ -129,9 +129,15 @@ def write_sigmf_svg_wrapper(meta, verbose, samp_count, fftsize, overlap,
                 x_end = width
             assert x_end - x, "Can't have freq lower edge above upper edge"
             w = x_end - x
+            # Our own detections are drawn in a different color from the
+            # dataset's annotations.
+            if annotation.get('core:generator') == 'renderfall':
+                color = '#00a000'
+            else:
+                color = '#bd0000'
             doc.append(SVG.rect(
                 x=x, y=y, width=w, height=h,
-                style='stroke:#bd0000; fill:#bd0000; fill-opacity:0.4'))
+                style='stroke:%s; fill:%s; fill-opacity:0.4' % (color, color)))
         else:
             if verbose:
                 print("Out of bounds, skipping.")
@@ -142,6 +148,34 @@ def write_sigmf_svg_wrapper(meta, verbose, samp_count, fftsize, overlap,
         f.write('\n'.join(doc))
 
 
+def detections_to_annotations(meta, events, fftsize, overlap):
+    """
+    Convert renderfall --detect events to SigMF annotations.
+    """
+    hop = fftsize - overlap
+    center_freq = float(meta['captures'][0]['core:frequency'])
+    samp_rate = float(meta['global']['core:sample_rate'])
+    start_freq = center_freq - (samp_rate / 2.0)
+    bin_width = samp_rate / fftsize
+
+    annotations = []
+    for ev in events:
+        # Frame f covers samples f * hop - overlap up to fftsize after that,
+        # since the first frame starts with overlap samples of silence.
+        start = max(0, ev['start_frame'] * hop - overlap)
+        end = ev['end_frame'] * hop - overlap + fftsize
+        annotations.append({
+            'core:sample_start': start,
+            'core:sample_count': end - start,
+            'core:freq_lower_edge': start_freq + ev['low_bin'] * bin_width,
+            'core:freq_upper_edge':
+                start_freq + (ev['high_bin'] + 1) * bin_width,
+            'core:generator': 'renderfall',
+            'core:comment': 'Energy detection, peak %.1f dB' % ev['peak_db'],
+        })
+    return annotations
+
+
 def main(argv=sys.argv):
     p = argparse.ArgumentParser(
         description='Render a SigMF-annotated spectrogram.')
@@ -157,6 +191,9 @@ def main(argv=sys.argv):
                    help='Overlap N samples per frame')
     p.add_argument('-c', '--clip', type=int,
                    help='Render only the first N samples from the dataset')
+    p.add_argument('-d', '--detect', action='store_true',
+                   help='Run energy detection, and draw and save the events '
+                   'as SigMF annotations')
     p.add_argument('-v', '--verbose', action='store_true',
                    help="Print verbose debugging output")
     p.add_argument('infile', help='SigMF file to render')
@@ -180,12 +217,6 @@ def main(argv=sys.argv):
     if opts.clip:
         samp_count = min(samp_count, opts.clip)
 
-    # Generate an SVG with annotations.
-    if opts.verbose:
-        print("Writing SVG wrapper to %s..." % out_svg_path)
-    write_sigmf_svg_wrapper(meta, opts.verbose, samp_count, opts.fftsize,
-                            opts.overlap, out_svg_path, out_png_path)
-
     # Get file offset to pass to renderfall.
     # XXX
 
@@ -200,6 +231,9 @@ def main(argv=sys.argv):
         '-l', str(opts.overlap or 0),
         '-c', str(opts.clip or 0),
     ]
+    if opts.detect:
+        events_path = out_base_path + '.detections.json'
+        cmd += ['--detect', events_path]
     if opts.verbose:
         cmd.append('-v')
     cmd.append(data_path)
@@ -207,6 +241,25 @@ def main(argv=sys.argv):
         print("Calling renderfall with: %r" % cmd)
     subprocess.check_call(cmd)
 
+    if opts.detect:
+        events = json.load(open(events_path, 'r'))
+        annotations = detections_to_annotations(meta, events, opts.fftsize,
+                                                opts.overlap or 0)
+        annotations_path = out_base_path + '.annotations.json'
+        if opts.verbose:
+            print("Writing %d detections to %s..." %
+                  (len(annotations), annotations_path))
+        with open(annotations_path, 'w') as f:
+            json.dump(annotations, f, indent=2)
+        meta = dict(meta)
+        meta['annotations'] = meta.get('annotations', []) + annotations
+
+    # Generate an SVG with annotations.
+    if opts.verbose:
+        print("Writing SVG wrapper to %s..." % out_svg_path)
+    write_sigmf_svg_wrapper(meta, opts.verbose, samp_count, opts.fftsize,
+                            opts.overlap, out_svg_path, out_png_path)
+
 
 if __name__ == '__main__':
     main()
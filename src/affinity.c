@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fftw3.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#include "affinity.h"
+
+// Most nodes we'll spread threads over.
+#define MAX_NODES 64
+
+int parse_cpu_list(const char *arg, int *cpus, int max) {
+    int n = 0;
+    const char *p = arg;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (n == max) {
+                return -1;
+            }
+            cpus[n++] = (int)cpu;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+bool numa_supported(void) {
+#ifdef HAVE_LIBNUMA
+    return numa_available() >= 0;
+#else
+    return false;
+#endif
+}
+
+static int cpu_node(int cpu) {
+#ifdef HAVE_LIBNUMA
+    if (numa_supported()) {
+        return numa_node_of_cpu(cpu);
+    }
+#endif
+    (void)cpu;
+    return -1;
+}
+
+// Nodes that have CPUs, in order of their first CPU.
+static int cpu_nodes(int *nodes) {
+    int n = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < ncpus; cpu++) {
+        int node = cpu_node(cpu);
+        if (node < 0) {
+            continue;
+        }
+        int i;
+        for (i = 0; i < n; i++) {
+            if (nodes[i] == node) {
+                break;
+            }
+        }
+        if (i == n && n < MAX_NODES) {
+            nodes[n++] = node;
+        }
+    }
+    return n;
+}
+
+void plan_placement(placement_t *placement, uint32_t n, const int *cpus,
+                    uint32_t ncpus, bool numa) {
+    int nodes[MAX_NODES];
+    int nnodes = 0;
+    if (numa && numa_supported()) {
+        nnodes = cpu_nodes(nodes);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        placement[i].cpu = -1;
+        placement[i].node = -1;
+        if (ncpus > 0) {
+            placement[i].cpu = cpus[i % ncpus];
+            if (nnodes > 0) {
+                placement[i].node = cpu_node(placement[i].cpu);
+            }
+        } else if (nnodes > 0) {
+            placement[i].node = nodes[i % nnodes];
+        }
+    }
+}
+
+int apply_placement(placement_t placement) {
+    if (placement.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(placement.cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            return -1;
+        }
+    }
+#ifdef HAVE_LIBNUMA
+    if (placement.node >= 0 && numa_supported()) {
+        if (placement.cpu < 0 && numa_run_on_node(placement.node) < 0) {
+            return -1;
+        }
+        // Anything else the thread allocates should come from its node too.
+        numa_set_preferred(placement.node);
+    }
+#endif
+    return 0;
+}
+
+placement_t place_thread(placement_t placement) {
+    // A restricted cpuset fails every thread the same way, so only say so
+    // once.
+    static bool warned = false;
+    if (apply_placement(placement) == 0) {
+        return placement;
+    }
+    if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Warning: failed to pin a thread to its CPU or "
+                        "NUMA node; leaving threads that can't be pinned "
+                        "unpinned.\n");
+    }
+    placement_t unpinned = {-1, -1};
+    return unpinned;
+}
+
+void *node_alloc(size_t size, int node) {
+#ifdef HAVE_LIBNUMA
+    // numa_alloc_onnode() returns whole pages, which is plenty of alignment.
+    if (node >= 0 && numa_supported()) {
+        return numa_alloc_onnode(size, node);
+    }
+#endif
+    (void)node;
+    return fftw_malloc(size);
+}
+
+void node_free(void *ptr, size_t size, int node) {
+#ifdef HAVE_LIBNUMA
+    if (node >= 0 && numa_supported()) {
+        numa_free(ptr, size);
+        return;
+    }
+#endif
+    (void)size;
+    (void)node;
+    fftw_free(ptr);
+}
+
+void print_placement(const char *name, placement_t placement) {
+    printf("%s: ", name);
+    if (placement.cpu >= 0) {
+        printf("cpu %d", placement.cpu);
+    } else {
+        printf("any cpu");
+    }
+    if (placement.node >= 0) {
+        printf(", node %d\n", placement.node);
+    } else {
+        printf(", no node binding\n");
+    }
+}
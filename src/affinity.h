@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Where a thread runs, and where its buffers live.
+typedef struct {
+    // CPU the thread is pinned to, or -1 if it isn't pinned to a single CPU.
+    int cpu;
+    // NUMA node the thread runs on and allocates from, or -1 for none.
+    int node;
+} placement_t;
+
+// Parse a CPU list like "0-7,16-23" into cpus. Returns the number of CPUs, or
+// -1 if the list is malformed or longer than max.
+int parse_cpu_list(const char *arg, int *cpus, int max);
+
+// True if we were built with libnuma and the kernel supports it.
+bool numa_supported(void);
+
+// Lay out n threads. With a CPU list, threads are pinned to its CPUs round
+// robin; with numa, threads are spread over the NUMA nodes round robin (on
+// their CPU's node, if pinned). Otherwise threads are left alone.
+void plan_placement(placement_t *placement, uint32_t n, const int *cpus,
+                    uint32_t ncpus, bool numa);
+
+// Move the calling thread to its placement. Returns -1 on failure.
+int apply_placement(placement_t placement);
+
+// Move the calling thread to its placement, and return where it ended up:
+// there, or unpinned ({-1, -1}) if it couldn't be moved. The first failure
+// is reported on stderr.
+placement_t place_thread(placement_t placement);
+
+// Allocate memory on a NUMA node (or anywhere, for node -1). The result is
+// suitably aligned for FFTW, and must be released with node_free().
+void *node_alloc(size_t size, int node);
+void node_free(void *ptr, size_t size, int node);
+
+void print_placement(const char *name, placement_t placement);
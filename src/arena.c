@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+// Alignment of every allocation: enough for any SIMD FFTW uses, and a cache
+// line, so buffers used by different threads never share one.
+#define ARENA_ALIGN 64
+
+// Size of the huge pages MAP_HUGETLB gives us by default.
+#define HUGE_PAGE_SIZE (2 << 20)
+
+struct arena {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    bool huge;
+    pthread_mutex_t lock;
+};
+
+arena_t *arena_create(size_t size, bool huge_pages) {
+    arena_t *a = (arena_t *)calloc(1, sizeof(arena_t));
+    pthread_mutex_init(&a->lock, NULL);
+    a->size = size ? size : 1;
+
+    // Populate the mapping straight away, so that the render doesn't take
+    // page faults (or find the memory isn't there after all) once it's going.
+    void *p = MAP_FAILED;
+    if (huge_pages) {
+        size_t len = (a->size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                     HUGE_PAGE_SIZE;
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1,
+                 0);
+        if (p != MAP_FAILED) {
+            a->size = len;
+            a->huge = true;
+        }
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | (huge_pages ? 0 : MAP_POPULATE),
+                 -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Error: failed to reserve %zu MB of memory.\n",
+                    a->size >> 20);
+            pthread_mutex_destroy(&a->lock);
+            free(a);
+            return NULL;
+        }
+        if (huge_pages) {
+            // Only takes effect for pages faulted in after the advice, so
+            // fault them in by hand.
+            madvise(p, a->size, MADV_HUGEPAGE);
+            for (size_t off = 0; off < a->size; off += 4096) {
+                ((volatile uint8_t *)p)[off] = 0;
+            }
+        }
+    }
+    a->base = (uint8_t *)p;
+    return a;
+}
+
+size_t arena_footprint(size_t size) {
+    return (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+void *arena_alloc(arena_t *a, size_t size) {
+    size = arena_footprint(size);
+    void *p = NULL;
+    pthread_mutex_lock(&a->lock);
+    if (size <= a->size - a->used) {
+        p = a->base + a->used;
+        a->used += size;
+    }
+    pthread_mutex_unlock(&a->lock);
+    return p;
+}
+
+bool arena_owns(const arena_t *a, const void *ptr) {
+    const uint8_t *p = (const uint8_t *)ptr;
+    return p >= a->base && p < a->base + a->size;
+}
+
+size_t arena_used(const arena_t *a) {
+    return a->used;
+}
+
+size_t arena_size(const arena_t *a) {
+    return a->size;
+}
+
+bool arena_huge_pages(const arena_t *a) {
+    return a->huge;
+}
+
+void arena_destroy(arena_t *a) {
+    munmap(a->base, a->size);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A fixed block of memory, reserved (and faulted in) up front, that buffers
+// are carved out of one after another. Nothing is freed until the whole arena
+// is, so everything a render needs can be sized and allocated before it
+// starts, and it never allocates again once it's running.
+typedef struct arena arena_t;
+
+// Reserve size bytes. With huge_pages, back them with explicit huge pages if
+// any are free, or else ask for transparent huge pages. Returns NULL (after
+// reporting why on stderr) if the memory can't be had.
+arena_t *arena_create(size_t size, bool huge_pages);
+
+// Carve out size bytes, aligned for FFTW. Returns NULL if the arena doesn't
+// have that much left. Safe to call from any thread.
+void *arena_alloc(arena_t *a, size_t size);
+
+// Bytes arena_alloc(size) takes out of an arena, for sizing one up front.
+size_t arena_footprint(size_t size);
+
+// True if ptr was carved out of the arena.
+bool arena_owns(const arena_t *a, const void *ptr);
+
+size_t arena_used(const arena_t *a);
+size_t arena_size(const arena_t *a);
+
+// True if the arena ended up on explicit huge pages.
+bool arena_huge_pages(const arena_t *a);
+
+void arena_destroy(arena_t *a);
@@ -1,15 +1,30 @@
 #include <float.h>
 #include <math.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <fftw3.h>
-#include <png.h>
 
-double maxdb = 0;
-double mindb = FLT_MAX;
+#include "colormap.h"
 
-int32_t maxval = 0;
-int32_t minval = INT32_MAX;
+void colormap_stats_init(colormap_stats_t *stats) {
+    stats->maxdb = 0;
+    stats->mindb = FLT_MAX;
+    stats->maxval = 0;
+    stats->minval = INT32_MAX;
+}
+
+void colormap_stats_merge(colormap_stats_t *dst, const colormap_stats_t *src) {
+    if (src->maxdb > dst->maxdb)
+        dst->maxdb = src->maxdb;
+    if (src->mindb < dst->mindb)
+        dst->mindb = src->mindb;
+    if (src->maxval > dst->maxval)
+        dst->maxval = src->maxval;
+    if (src->minval < dst->minval)
+        dst->minval = src->minval;
+}
 
 void hsv_to_rgb(double *r, double *g, double *b, double h, double s, double v) {
     // Note that right now, hue goes from 0 to 1.0 and not 0 to 360..
@@ -57,21 +72,21 @@ void hsv_to_rgb(double *r, double *g, double *b, double h, double s, double v) {
     }
 }
 
-void scale_log(png_byte *ptr, double val) {
+void scale_log(colormap_stats_t *stats, uint8_t *ptr, double val) {
     // Make a monochromatic black-on-white output for now.
     double db = log10(val);
-    if (db > maxdb)
-        maxdb = db;
-    if (db < mindb)
-        mindb = db;
+    if (db > stats->maxdb)
+        stats->maxdb = db;
+    if (db < stats->mindb)
+        stats->mindb = db;
 
     // Kind of arbitrarily picked.
     int32_t v = (int32_t)((db * 85.0f) + 200.0f);
 
-    if (v > maxval)
-        maxval = v;
-    if (v < minval)
-        minval = v;
+    if (v > stats->maxval)
+        stats->maxval = v;
+    if (v < stats->minval)
+        stats->minval = v;
 
     v = 255 - v;
 
@@ -85,25 +100,25 @@ void scale_log(png_byte *ptr, double val) {
     ptr[2] = (uint8_t)v;
 }
 
-void scale_log_hue(png_byte *ptr, double val) {
+void scale_log_hue(colormap_stats_t *stats, uint8_t *ptr, double val) {
     double h = 0.0, s = 0.0, v = 0.0;
     double r, g, b;
 
     double db = log10(val);
-    if (db > maxdb)
-        maxdb = db;
-    if (db < mindb)
-        mindb = db;
+    if (db > stats->maxdb)
+        stats->maxdb = db;
+    if (db < stats->mindb)
+        stats->mindb = db;
 
     // Kind of arbitrarily picked.
     h = (db + 4.0) / 4.0;
     s = 1.0;
     v = 1.0;
 
-    if (h > maxval)
-        maxval = h;
-    if (h < minval)
-        minval = h;
+    if (h > stats->maxval)
+        stats->maxval = h;
+    if (h < stats->minval)
+        stats->minval = h;
 
     if (h > 1.0)
         h = 1.0;
@@ -117,12 +132,12 @@ void scale_log_hue(png_byte *ptr, double val) {
     ptr[2] = (uint8_t)(255.0 * b);
 }
 
-void scale_linear(png_byte *ptr, double val) {
+void scale_linear(colormap_stats_t *stats, uint8_t *ptr, double val) {
     int32_t v = (int32_t)(val * 100.0f);
-    if (v > maxval)
-        maxval = v;
-    if (v < minval)
-        minval = v;
+    if (v > stats->maxval)
+        stats->maxval = v;
+    if (v < stats->minval)
+        stats->minval = v;
 
     if (v > 255)
         v = 255;
@@ -135,15 +150,42 @@ void scale_linear(png_byte *ptr, double val) {
     ptr[2] = (uint8_t)v;
 }
 
-void render_complex(png_byte *ptr, fftw_complex val) {
+double render_complex(colormap_stats_t *stats, uint8_t *ptr,
+                      fftw_complex val) {
     double mag = hypot(val[0], val[1]);
-    scale_log(ptr, mag);
+    scale_log(stats, ptr, mag);
+    return mag * mag;
+}
+
+void print_scale_stats(const colormap_stats_t *stats) {
+    printf("Max dB: %f\n", stats->maxdb);
+    printf("Min dB: %f\n", stats->mindb);
+
+    printf("Max value: %d\n", stats->maxval);
+    printf("Min value: %d\n", stats->minval);
 }
 
-void print_scale_stats() {
-    printf("Max dB: %f\n", maxdb);
-    printf("Min dB: %f\n", mindb);
+int parse_colormap(colormap_t *cm, const char *name) {
+    if (!strcmp(name, "gray")) {
+        *cm = COLORMAP_GRAY;
+    } else if (!strcmp(name, "hue")) {
+        *cm = COLORMAP_HUE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
 
-    printf("Max value: %d\n", maxval);
-    printf("Min value: %d\n", minval);
+void colormap_lut(colormap_t cm, uint8_t lut[256][3]) {
+    for (int i = 0; i < 256; i++) {
+        if (cm == COLORMAP_HUE) {
+            double r, g, b;
+            hsv_to_rgb(&r, &g, &b, i / 255.0, 1.0, 1.0);
+            lut[i][0] = (uint8_t)(255.0 * r);
+            lut[i][1] = (uint8_t)(255.0 * g);
+            lut[i][2] = (uint8_t)(255.0 * b);
+        } else {
+            lut[i][0] = lut[i][1] = lut[i][2] = (uint8_t)(255 - i);
+        }
+    }
 }
@@ -1,7 +1,37 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <fftw3.h>
 
-void render_complex(png_byte *ptr, fftw_complex val);
+// Running statistics about the values seen by the colormap, kept per render.
+typedef struct {
+    double maxdb;
+    double mindb;
+    int32_t maxval;
+    int32_t minval;
+} colormap_stats_t;
+
+void colormap_stats_init(colormap_stats_t *stats);
+// Fold the statistics from src into dst.
+void colormap_stats_merge(colormap_stats_t *dst, const colormap_stats_t *src);
+
+// Color one bin. Returns its power (squared magnitude).
+double render_complex(colormap_stats_t *stats, uint8_t *ptr,
+                      fftw_complex val);
+
+void print_scale_stats(const colormap_stats_t *stats);
+
+// Color palettes for values that are already in dB, e.g. from a spectral
+// cache.
+typedef enum {
+    // Black on white, as in rendered images.
+    COLORMAP_GRAY = 0,
+    COLORMAP_HUE,
+} colormap_t;
+
+// Returns -1 for an unknown palette name.
+int parse_colormap(colormap_t *cm, const char *name);
 
-void print_scale_stats();
+// Fill in the 256 colors of a palette, from the bottom of the range up.
+void colormap_lut(colormap_t cm, uint8_t lut[256][3]);
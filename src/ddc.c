@@ -0,0 +1,150 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fftw3.h>
+
+#include "ddc.h"
+#include "window.h"
+
+static void make_lowpass(double *taps, uint32_t ntaps, double cutoff) {
+    // Windowed sinc, Blackman windowed, normalized for unity gain at DC.
+    window_t win = make_window_blackman(ntaps);
+    double center = (ntaps - 1) / 2.0;
+    double sum = 0;
+    for (uint32_t k = 0; k < ntaps; k++) {
+        double t = k - center;
+        double sinc = (t == 0) ? 2.0 * cutoff
+                               : sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+        taps[ntaps - 1 - k] = sinc * win.coeffs[k];
+        sum += sinc * win.coeffs[k];
+    }
+    for (uint32_t k = 0; k < ntaps; k++) {
+        taps[k] /= sum;
+    }
+    destroy_window(win);
+}
+
+uint32_t ddc_decimation(double bandwidth) {
+    return (uint32_t)floor(1.0 / bandwidth);
+}
+
+ddc_t *ddc_create(double freq, double bandwidth) {
+    if (bandwidth <= 0 || bandwidth > 1.0) {
+        return NULL;
+    }
+
+    ddc_t *ddc = (ddc_t *)calloc(1, sizeof(ddc_t));
+    ddc->decim = ddc_decimation(bandwidth);
+
+    ddc->ntaps = ddc->decim * DDC_TAPS_PER_PHASE;
+    ddc->taps = (double *)malloc(ddc->ntaps * sizeof(double));
+    make_lowpass(ddc->taps, ddc->ntaps, bandwidth / 2.0);
+
+    ddc->hist = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * 2 *
+                                            ddc->ntaps);
+    memset(ddc->hist, 0, sizeof(fftw_complex) * 2 * ddc->ntaps);
+
+    // Shift the band of interest down by freq: lane k starts k samples into
+    // the NCO, and every lane advances DDC_NCO_LANES samples per step.
+    double w = -2.0 * M_PI * freq;
+    for (uint32_t k = 0; k < DDC_NCO_LANES; k++) {
+        ddc->nco_re[k] = cos(w * k);
+        ddc->nco_im[k] = sin(w * k);
+    }
+    ddc->step_re = cos(w * DDC_NCO_LANES);
+    ddc->step_im = sin(w * DDC_NCO_LANES);
+
+    return ddc;
+}
+
+void ddc_destroy(ddc_t *ddc) {
+    free(ddc->taps);
+    fftw_free(ddc->hist);
+    free(ddc);
+}
+
+static void nco_mix(ddc_t *ddc, fftw_complex *buf, uint32_t n) {
+    double *re = ddc->nco_re;
+    double *im = ddc->nco_im;
+    uint32_t i = 0;
+
+    for (; i + DDC_NCO_LANES <= n; i += DDC_NCO_LANES) {
+        for (uint32_t k = 0; k < DDC_NCO_LANES; k++) {
+            double xr = buf[i + k][0];
+            double xi = buf[i + k][1];
+            buf[i + k][0] = xr * re[k] - xi * im[k];
+            buf[i + k][1] = xr * im[k] + xi * re[k];
+
+            double nr = re[k] * ddc->step_re - im[k] * ddc->step_im;
+            double ni = re[k] * ddc->step_im + im[k] * ddc->step_re;
+            re[k] = nr;
+            im[k] = ni;
+        }
+    }
+
+    // Leftover samples use the first few lanes, after which the lanes are
+    // rotated so that lane 0 is once again the next sample.
+    uint32_t rem = n - i;
+    if (rem > 0) {
+        double tmp_re[DDC_NCO_LANES], tmp_im[DDC_NCO_LANES];
+        for (uint32_t k = 0; k < rem; k++) {
+            double xr = buf[i + k][0];
+            double xi = buf[i + k][1];
+            buf[i + k][0] = xr * re[k] - xi * im[k];
+            buf[i + k][1] = xr * im[k] + xi * re[k];
+        }
+        for (uint32_t k = 0; k < DDC_NCO_LANES; k++) {
+            uint32_t src = k + rem;
+            if (src < DDC_NCO_LANES) {
+                tmp_re[k] = re[src];
+                tmp_im[k] = im[src];
+            } else {
+                src -= DDC_NCO_LANES;
+                tmp_re[k] = re[src] * ddc->step_re - im[src] * ddc->step_im;
+                tmp_im[k] = re[src] * ddc->step_im + im[src] * ddc->step_re;
+            }
+        }
+        memcpy(re, tmp_re, sizeof(tmp_re));
+        memcpy(im, tmp_im, sizeof(tmp_im));
+    }
+
+    // Keep rounding error from slowly changing the NCO amplitude.
+    for (uint32_t k = 0; k < DDC_NCO_LANES; k++) {
+        double mag = hypot(re[k], im[k]);
+        re[k] /= mag;
+        im[k] /= mag;
+    }
+}
+
+uint32_t ddc_process(ddc_t *ddc, fftw_complex *in, uint32_t n,
+                     fftw_complex *out) {
+    nco_mix(ddc, in, n);
+
+    uint32_t ntaps = ddc->ntaps;
+    uint32_t nout = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        fftw_complex *h = ddc->hist;
+        uint32_t pos = ddc->hist_pos;
+        h[pos][0] = h[pos + ntaps][0] = in[i][0];
+        h[pos][1] = h[pos + ntaps][1] = in[i][1];
+        ddc->hist_pos = (pos + 1 == ntaps) ? 0 : pos + 1;
+
+        // Only the output samples we keep are ever computed, so each input
+        // sample costs DDC_TAPS_PER_PHASE multiply-accumulates.
+        if (++ddc->phase == ddc->decim) {
+            ddc->phase = 0;
+            fftw_complex *window = h + ddc->hist_pos;
+            double acc_re = 0, acc_im = 0;
+            for (uint32_t k = 0; k < ntaps; k++) {
+                acc_re += ddc->taps[k] * window[k][0];
+                acc_im += ddc->taps[k] * window[k][1];
+            }
+            out[nout][0] = acc_re;
+            out[nout][1] = acc_im;
+            nout++;
+        }
+    }
+    return nout;
+}
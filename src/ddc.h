@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <fftw3.h>
+
+// Number of NCO phasors advanced in lockstep, so the mixing loop can be
+// vectorized.
+#define DDC_NCO_LANES 8
+
+// Prototype filter length per polyphase branch.
+#define DDC_TAPS_PER_PHASE 16
+
+typedef struct {
+    // Decimation factor.
+    uint32_t decim;
+
+    // Low-pass prototype filter, stored reversed.
+    uint32_t ntaps;
+    double *taps;
+
+    // Mixed input history, doubled up so that the most recent ntaps samples
+    // are always contiguous.
+    fftw_complex *hist;
+    uint32_t hist_pos;
+
+    // Input samples consumed since the last output sample.
+    uint32_t phase;
+
+    // NCO state: one phasor per lane, and the rotation applied to every lane
+    // per step.
+    double nco_re[DDC_NCO_LANES];
+    double nco_im[DDC_NCO_LANES];
+    double step_re;
+    double step_im;
+} ddc_t;
+
+// Decimation factor used for a given (normalized) bandwidth.
+uint32_t ddc_decimation(double bandwidth);
+
+// Frequency and bandwidth are normalized to the input sample rate (cycles per
+// sample).
+ddc_t *ddc_create(double freq, double bandwidth);
+void ddc_destroy(ddc_t *ddc);
+
+// Mix n input samples (in place) down to baseband, low-pass filter and
+// decimate them. Writes up to (n + decim - 1) / decim samples to out and
+// returns the number written.
+uint32_t ddc_process(ddc_t *ddc, fftw_complex *in, uint32_t n,
+                     fftw_complex *out);
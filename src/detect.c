@@ -0,0 +1,300 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "detect.h"
+
+// How much slower the floor moves while a bin is on.
+#define ON_FLOOR_RATE (1.0f / 16)
+
+typedef struct {
+    detect_event_t ev;
+    // Bins the event covered in the previous frame, and so far in this one.
+    uint32_t prev_low, prev_high;
+    uint32_t cur_low, cur_high;
+    // Strongest power seen; ev.peak_db is only filled in when it's reported.
+    double peak;
+    // Whether it was there in the previous frame, and is in this one.
+    bool had_prev;
+    bool seen;
+} open_event_t;
+
+typedef struct {
+    float *floor;
+    bool *on;
+    open_event_t *open;
+    uint32_t nopen;
+    uint32_t cap;
+} channel_state_t;
+
+struct detector {
+    detect_params_t params;
+    uint32_t nbins;
+    uint32_t channels;
+    channel_state_t *state;
+    bool started;
+
+    // Threshold and hysteresis as power ratios.
+    float on_ratio;
+    float off_ratio;
+
+    detect_event_fn fn;
+    void *userdata;
+
+    // Where the state came from, if not the heap, and room for sorting a
+    // frame's power.
+    arena_t *arena;
+    float *sorted;
+};
+
+// Most events a channel can have open at once: one per run of bins in the
+// previous frame, plus one per run in this one.
+static uint32_t max_open(uint32_t nbins) {
+    return nbins + 1;
+}
+
+size_t detector_memory(uint32_t nbins, uint32_t channels) {
+    return arena_footprint(nbins * sizeof(float)) +
+           channels * (arena_footprint(nbins * sizeof(float)) +
+                       arena_footprint(nbins * sizeof(bool)) +
+                       arena_footprint(max_open(nbins) * sizeof(open_event_t)));
+}
+
+// Zeroed memory from the arena, or the heap without one (or if it's full).
+static void *alloc_zeroed(arena_t *arena, size_t size) {
+    void *p = arena ? arena_alloc(arena, size) : NULL;
+    if (!p) {
+        return calloc(1, size);
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+static void free_state(detector_t *d, void *p) {
+    if (!d->arena || !arena_owns(d->arena, p)) {
+        free(p);
+    }
+}
+
+detector_t *detector_create(const detect_params_t *params, uint32_t nbins,
+                            uint32_t channels, detect_event_fn fn,
+                            void *userdata, arena_t *arena) {
+    detector_t *d = (detector_t *)calloc(1, sizeof(detector_t));
+    d->params = *params;
+    d->nbins = nbins;
+    d->channels = channels;
+    d->fn = fn;
+    d->userdata = userdata;
+    d->arena = arena;
+    d->on_ratio = (float)pow(10.0, params->threshold / 10.0);
+    d->off_ratio =
+        (float)pow(10.0, (params->threshold - params->hysteresis) / 10.0);
+    d->state = (channel_state_t *)calloc(channels, sizeof(channel_state_t));
+    for (uint32_t c = 0; c < channels; c++) {
+        channel_state_t *cs = &d->state[c];
+        cs->floor = (float *)alloc_zeroed(arena, nbins * sizeof(float));
+        cs->on = (bool *)alloc_zeroed(arena, nbins * sizeof(bool));
+        // With an arena, make room for as many events as there can ever be,
+        // so that they never need to grow.
+        if (arena) {
+            cs->cap = max_open(nbins);
+            cs->open = (open_event_t *)alloc_zeroed(
+                arena, cs->cap * sizeof(open_event_t));
+        }
+    }
+    d->sorted = (float *)alloc_zeroed(arena, nbins * sizeof(float));
+    return d;
+}
+
+void detector_destroy(detector_t *d) {
+    for (uint32_t c = 0; c < d->channels; c++) {
+        free_state(d, d->state[c].floor);
+        free_state(d, d->state[c].on);
+        free_state(d, d->state[c].open);
+    }
+    free_state(d, d->sorted);
+    free(d->state);
+    free(d);
+}
+
+static int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Start every bin's floor at the noise power estimated from the median of the
+// first frame (noise power is exponentially distributed, so its median is ln 2
+// of its mean), so that a signal that's already there isn't mistaken for the
+// floor.
+static void init_floor(detector_t *d, channel_state_t *cs, const float *power) {
+    float *sorted = d->sorted;
+    memcpy(sorted, power, d->nbins * sizeof(float));
+    qsort(sorted, d->nbins, sizeof(float), compare_floats);
+    for (uint32_t b = 0; b < d->nbins; b++) {
+        cs->floor[b] = sorted[d->nbins / 2] / (float)M_LN2;
+    }
+}
+
+static void merge_event(open_event_t *dst, const open_event_t *src) {
+    if (src->ev.start_frame < dst->ev.start_frame)
+        dst->ev.start_frame = src->ev.start_frame;
+    if (src->ev.end_frame > dst->ev.end_frame)
+        dst->ev.end_frame = src->ev.end_frame;
+    if (src->ev.low_bin < dst->ev.low_bin)
+        dst->ev.low_bin = src->ev.low_bin;
+    if (src->ev.high_bin > dst->ev.high_bin)
+        dst->ev.high_bin = src->ev.high_bin;
+    if (src->peak > dst->peak)
+        dst->peak = src->peak;
+
+    if (src->prev_low < dst->prev_low)
+        dst->prev_low = src->prev_low;
+    if (src->prev_high > dst->prev_high)
+        dst->prev_high = src->prev_high;
+    if (src->seen) {
+        if (!dst->seen) {
+            dst->cur_low = src->cur_low;
+            dst->cur_high = src->cur_high;
+            dst->seen = true;
+        } else {
+            if (src->cur_low < dst->cur_low)
+                dst->cur_low = src->cur_low;
+            if (src->cur_high > dst->cur_high)
+                dst->cur_high = src->cur_high;
+        }
+    }
+}
+
+// Fold a run of bins that are on into the open events. The run continues
+// every event that touched it in the previous frame (which joins those
+// events into one), or else starts a new event.
+static void add_run(channel_state_t *cs, uint32_t c, uint64_t frame,
+                    uint32_t low, uint32_t high, double peak) {
+    open_event_t *match = NULL;
+    for (uint32_t i = 0; i < cs->nopen;) {
+        open_event_t *e = &cs->open[i];
+        if (!e->had_prev || e->prev_low > high + 1 || e->prev_high + 1 < low) {
+            i++;
+        } else if (!match) {
+            match = e;
+            i++;
+        } else {
+            // The match comes earlier in the list, so it doesn't move.
+            merge_event(match, e);
+            *e = cs->open[--cs->nopen];
+        }
+    }
+
+    if (!match) {
+        if (cs->nopen == cs->cap) {
+            cs->cap = cs->cap ? 2 * cs->cap : 16;
+            cs->open = (open_event_t *)realloc(cs->open,
+                                               cs->cap * sizeof(open_event_t));
+        }
+        match = &cs->open[cs->nopen++];
+        memset(match, 0, sizeof(open_event_t));
+        match->ev.start_frame = frame;
+        match->ev.low_bin = low;
+        match->ev.high_bin = high;
+        match->ev.channel = c;
+        match->peak = peak;
+    }
+
+    if (!match->seen) {
+        match->cur_low = low;
+        match->cur_high = high;
+        match->seen = true;
+    } else {
+        if (low < match->cur_low)
+            match->cur_low = low;
+        if (high > match->cur_high)
+            match->cur_high = high;
+    }
+    match->ev.end_frame = frame;
+    if (low < match->ev.low_bin)
+        match->ev.low_bin = low;
+    if (high > match->ev.high_bin)
+        match->ev.high_bin = high;
+    if (peak > match->peak)
+        match->peak = peak;
+}
+
+// Report the events that didn't continue into this frame.
+static void close_events(detector_t *d, channel_state_t *cs, bool all) {
+    for (uint32_t i = 0; i < cs->nopen;) {
+        open_event_t *e = &cs->open[i];
+        if (all || !e->seen) {
+            if (e->ev.end_frame - e->ev.start_frame + 1 >=
+                d->params.min_frames) {
+                e->ev.peak_db = 10.0 * log10(e->peak);
+                d->fn(d->userdata, &e->ev);
+            }
+            *e = cs->open[--cs->nopen];
+        } else {
+            e->prev_low = e->cur_low;
+            e->prev_high = e->cur_high;
+            e->had_prev = true;
+            e->seen = false;
+            i++;
+        }
+    }
+}
+
+void detector_process(detector_t *d, uint64_t frame, const float *power) {
+    float alpha = (float)d->params.alpha;
+    float creep = 1.0f + (alpha * ON_FLOOR_RATE);
+
+    for (uint32_t c = 0; c < d->channels; c++) {
+        channel_state_t *cs = &d->state[c];
+        const float *p = power + ((size_t)c * d->nbins);
+
+        if (!d->started) {
+            init_floor(d, cs, p);
+        }
+
+        uint32_t run_start = 0;
+        double run_peak = 0;
+        bool in_run = false;
+        for (uint32_t b = 0; b < d->nbins; b++) {
+            float floor = cs->floor[b];
+            cs->on[b] = cs->on[b] ? (p[b] >= floor * d->off_ratio)
+                                  : (p[b] > floor * d->on_ratio);
+            // The floor follows the bin while there's no signal in it, and
+            // only creeps up (by a fixed number of dB per frame) while there
+            // is, so that a jump in the noise floor can't keep it on for good.
+            if (cs->on[b]) {
+                cs->floor[b] = floor * creep;
+            } else {
+                cs->floor[b] = floor + alpha * (p[b] - floor);
+            }
+
+            if (cs->on[b]) {
+                if (!in_run) {
+                    in_run = true;
+                    run_start = b;
+                    run_peak = p[b];
+                } else if (p[b] > run_peak) {
+                    run_peak = p[b];
+                }
+            } else if (in_run) {
+                add_run(cs, c, frame, run_start, b - 1, run_peak);
+                in_run = false;
+            }
+        }
+        if (in_run) {
+            add_run(cs, c, frame, run_start, d->nbins - 1, run_peak);
+        }
+
+        close_events(d, cs, false);
+    }
+    d->started = true;
+}
+
+void detector_finish(detector_t *d) {
+    for (uint32_t c = 0; c < d->channels; c++) {
+        close_events(d, &d->state[c], true);
+    }
+}
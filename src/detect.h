@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// Energy detector run over the rendered spectrum. Each bin tracks its own
+// noise floor (a moving average of its power while it's off), and switches on
+// when its power rises threshold dB above it, then off again once it drops
+// back below threshold - hysteresis. Bins that are on in adjacent frames and
+// neighbouring bins are grouped into events.
+typedef struct {
+    // Frames, counted from the start of the render, inclusive.
+    uint64_t start_frame;
+    uint64_t end_frame;
+    // Bins in row order (lowest frequency first), inclusive.
+    uint32_t low_bin;
+    uint32_t high_bin;
+    uint32_t channel;
+    // Strongest bin seen, in dB.
+    double peak_db;
+} detect_event_t;
+
+typedef void (*detect_event_fn)(void *userdata, const detect_event_t *event);
+
+typedef struct {
+    // Level above the noise floor a bin has to reach, in dB.
+    double threshold;
+    // How far below the threshold a bin has to fall to switch off again.
+    double hysteresis;
+    // Weight of each new frame in the noise floor's moving average.
+    double alpha;
+    // Shorter events are dropped, as they're almost always noise.
+    uint32_t min_frames;
+} detect_params_t;
+
+#define DETECT_DEFAULT_THRESHOLD 10.0
+#define DETECT_DEFAULT_HYSTERESIS 3.0
+#define DETECT_DEFAULT_ALPHA 0.01
+#define DETECT_DEFAULT_MIN_FRAMES 2
+
+typedef struct detector detector_t;
+
+// With an arena, the detector's state comes out of it (see detector_memory())
+// and it never allocates once created; otherwise it allocates as it goes.
+detector_t *detector_create(const detect_params_t *params, uint32_t nbins,
+                            uint32_t channels, detect_event_fn fn,
+                            void *userdata, arena_t *arena);
+
+// Bytes a detector takes out of its arena.
+size_t detector_memory(uint32_t nbins, uint32_t channels);
+
+// Feed the next frame: the power (squared magnitude) of nbins bins for each
+// channel, one channel after another. Frames must come in order.
+void detector_process(detector_t *d, uint64_t frame, const float *power);
+
+// Report any events still open.
+void detector_finish(detector_t *d);
+
+void detector_destroy(detector_t *d);
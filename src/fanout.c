@@ -0,0 +1,139 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fftw3.h>
+
+#include "arena.h"
+#include "fanout.h"
+
+// Largest sample accepted: float64 I/Q on every one of 64 channels.
+#define MAX_STRIDE (64 * 2 * sizeof(double))
+
+struct fanout {
+    convert_samples_fn convert;
+    size_t sample_size;
+    uint32_t channels;
+
+    waterfall_t **renders;
+    bool *active;
+    uint32_t nrenders;
+    uint32_t nactive;
+
+    // Converted block, grown to fit the largest block pushed so far (unless
+    // it was sized up front, maybe out of an arena).
+    fftw_complex *buf;
+    size_t buf_len;
+    arena_t *arena;
+
+    // Bytes of a sample split across two blocks.
+    uint8_t partial[MAX_STRIDE];
+    size_t partial_len;
+};
+
+// Complex values converted from a block of max_len bytes.
+static size_t converted_len(format_t format, uint32_t channels,
+                            size_t max_len) {
+    channels = (channels > 0) ? channels : 1;
+    size_t samples = max_len / (format_sample_size(format) * channels);
+    return ((samples > 0) ? samples : 1) * channels;
+}
+
+size_t fanout_memory(format_t format, uint32_t channels, size_t max_len) {
+    return arena_footprint(converted_len(format, channels, max_len) *
+                           sizeof(fftw_complex));
+}
+
+fanout_t *fanout_create(format_t format, uint32_t channels, size_t max_len,
+                        arena_t *arena) {
+    fanout_t *f = (fanout_t *)calloc(1, sizeof(fanout_t));
+    f->convert = format_converter(format);
+    f->sample_size = format_sample_size(format);
+    f->channels = (channels > 0) ? channels : 1;
+    if (max_len > 0) {
+        size_t n = converted_len(format, channels, max_len);
+        size_t size = n * sizeof(fftw_complex);
+        f->buf = arena ? (fftw_complex *)arena_alloc(arena, size) : NULL;
+        if (f->buf)
+            f->arena = arena;
+        else
+            f->buf = (fftw_complex *)fftw_malloc(size);
+        f->buf_len = n;
+    }
+    return f;
+}
+
+void fanout_add(fanout_t *f, waterfall_t *wf) {
+    f->renders = (waterfall_t **)realloc(
+        f->renders, (f->nrenders + 1) * sizeof(waterfall_t *));
+    f->active = (bool *)realloc(f->active, (f->nrenders + 1) * sizeof(bool));
+    f->renders[f->nrenders] = wf;
+    f->active[f->nrenders] = true;
+    f->nrenders++;
+    f->nactive++;
+}
+
+static void reserve(fanout_t *f, size_t n) {
+    if (n > f->buf_len) {
+        if (!f->arena)
+            fftw_free(f->buf);
+        f->arena = NULL;
+        f->buf = (fftw_complex *)fftw_malloc(n * sizeof(fftw_complex));
+        f->buf_len = n;
+    }
+}
+
+static void push_converted(fanout_t *f, size_t n) {
+    for (uint32_t i = 0; i < f->nrenders; i++) {
+        if (f->active[i] &&
+            !waterfall_push(f->renders[i], f->buf, n * sizeof(fftw_complex))) {
+            f->active[i] = false;
+            f->nactive--;
+        }
+    }
+}
+
+bool fanout_push(fanout_t *f, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    size_t stride = f->sample_size * f->channels;
+
+    if (f->partial_len > 0) {
+        size_t take = stride - f->partial_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(f->partial + f->partial_len, p, take);
+        f->partial_len += take;
+        p += take;
+        len -= take;
+        if (f->partial_len < stride) {
+            return f->nactive > 0;
+        }
+        reserve(f, f->channels);
+        f->convert(f->partial, f->sample_size, f->buf, f->channels);
+        f->partial_len = 0;
+        push_converted(f, f->channels);
+    }
+
+    // One complex value per channel per sample.
+    size_t n = (len / stride) * f->channels;
+    reserve(f, n);
+    if (n > 0) {
+        f->convert(p, f->sample_size, f->buf, (uint32_t)n);
+        push_converted(f, n);
+    }
+
+    f->partial_len = len % stride;
+    memcpy(f->partial, p + (len - f->partial_len), f->partial_len);
+
+    return f->nactive > 0;
+}
+
+void fanout_destroy(fanout_t *f) {
+    if (!f->arena)
+        fftw_free(f->buf);
+    free(f->renders);
+    free(f->active);
+    free(f);
+}
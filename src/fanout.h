@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "formats.h"
+#include "waterfall.h"
+
+// Feeds one input stream to several renders. Each block is converted to
+// complex doubles once, and the converted samples are pushed to every render,
+// which must have been created with FORMAT_FLOAT64 input and the same channel
+// count.
+typedef struct fanout fanout_t;
+
+// Blocks are converted into a buffer sized for blocks of max_len bytes (out of
+// arena, if there is one) and grown if a bigger one comes along. With a
+// max_len of 0, it's sized by the first block.
+fanout_t *fanout_create(format_t format, uint32_t channels, size_t max_len,
+                        arena_t *arena);
+
+// Bytes a fanout takes out of its arena.
+size_t fanout_memory(format_t format, uint32_t channels, size_t max_len);
+void fanout_add(fanout_t *f, waterfall_t *wf);
+
+// Push a block of raw samples to every render that still wants input.
+// Returns false once they have all reached their clip limit.
+bool fanout_push(fanout_t *f, const void *buf, size_t len);
+
+void fanout_destroy(fanout_t *f);
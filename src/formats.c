@@ -1,79 +1,379 @@
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+
+// SSE2 is part of x86-64, so its kernels are always built there. The SSSE3
+// one is built for SSSE3 whatever the target, and only used if the CPU has
+// it.
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
 
 #include "formats.h"
 
-void read_samples_int8(FILE *fp, fftw_complex *buf, uint32_t n) {
-    int8_t *raw = (int8_t *)malloc(n * 2 * sizeof(int8_t));
-    fread(raw, 2, n, fp);
-    for (uint32_t i = 0; i < n; i++) {
-        buf[i][0] = ((double)raw[i] / INT8_MAX);
-        buf[i][1] = ((double)raw[i + 1] / INT8_MAX);
+// Largest values of the packed formats.
+#define SC12_MAX 2047
+#define SC4_MAX 7
+
+// The raw buffers come straight from the caller and may not be aligned for
+// their sample type, so every load goes through memcpy (which compiles down
+// to a plain load where the target allows it). De-interleaving happens right
+// here, as each sample is loaded, rather than in a separate shuffling pass;
+// the SSE2 kernels below do it with shuffles for the common channel counts.
+// A float32 sample is 64 bits, so compilers already pick it out with a single
+// load and widen it with one conversion.
+#define CONVERT_SAMPLES(name, type, scale)                                     \
+    void convert_samples_##name(const void *raw, size_t stride,               \
+                                fftw_complex *buf, uint32_t n) {               \
+        const uint8_t *p = (const uint8_t *)raw;                               \
+        for (uint32_t i = 0; i < n; i++) {                                     \
+            type v[2];                                                         \
+            memcpy(v, p + (i * stride), sizeof(v));                            \
+            buf[i][0] = ((double)v[0] / (scale));                              \
+            buf[i][1] = ((double)v[1] / (scale));                              \
+        }                                                                      \
+    }
+
+// Same again for big-endian samples: byte swap as unsigned words, then
+// reinterpret them as type.
+#define CONVERT_SAMPLES_BE(name, type, word, swap, scale)                      \
+    void convert_samples_##name(const void *raw, size_t stride,               \
+                                fftw_complex *buf, uint32_t n) {               \
+        const uint8_t *p = (const uint8_t *)raw;                               \
+        for (uint32_t i = 0; i < n; i++) {                                     \
+            word w[2];                                                         \
+            type v[2];                                                         \
+            memcpy(w, p + (i * stride), sizeof(w));                            \
+            w[0] = swap(w[0]);                                                 \
+            w[1] = swap(w[1]);                                                 \
+            memcpy(v, w, sizeof(v));                                           \
+            buf[i][0] = ((double)v[0] / (scale));                              \
+            buf[i][1] = ((double)v[1] / (scale));                              \
+        }                                                                      \
     }
-    free(raw);
+
+CONVERT_SAMPLES(int8, int8_t, INT8_MAX)
+CONVERT_SAMPLES(uint8, uint8_t, UINT8_MAX)
+CONVERT_SAMPLES(uint16, uint16_t, UINT16_MAX)
+CONVERT_SAMPLES(int32, int32_t, INT32_MAX)
+CONVERT_SAMPLES(uint32, uint32_t, UINT32_MAX)
+CONVERT_SAMPLES(float32, float, 1.0)
+
+CONVERT_SAMPLES_BE(uint16be, uint16_t, uint16_t, __builtin_bswap16,
+                   UINT16_MAX)
+CONVERT_SAMPLES_BE(int32be, int32_t, uint32_t, __builtin_bswap32, INT32_MAX)
+CONVERT_SAMPLES_BE(uint32be, uint32_t, uint32_t, __builtin_bswap32,
+                   UINT32_MAX)
+CONVERT_SAMPLES_BE(float32be, float, uint32_t, __builtin_bswap32, 1.0)
+CONVERT_SAMPLES_BE(float64be, double, uint64_t, __builtin_bswap64, 1.0)
+
+#ifdef __SSE2__
+// Sign extend eight int16 values to doubles, scale them, and store them.
+// Divides rather than multiplying by the reciprocal so that the results match
+// the scalar code exactly.
+static inline void store_int16x8(__m128i v, double *out, __m128d scale) {
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_pd(out, _mm_div_pd(_mm_cvtepi32_pd(lo), scale));
+    _mm_storeu_pd(out + 2,
+                  _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(lo, 0x4e)),
+                             scale));
+    _mm_storeu_pd(out + 4, _mm_div_pd(_mm_cvtepi32_pd(hi), scale));
+    _mm_storeu_pd(out + 6,
+                  _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(hi, 0x4e)),
+                             scale));
 }
 
-void read_samples_uint8(FILE *fp, fftw_complex *buf, uint32_t n) {
-    int8_t *raw = (int8_t *)malloc(n * 2 * sizeof(uint8_t));
-    fread(raw, 2, n, fp);
-    for (uint32_t i = 0; i < n; i++) {
-        buf[i][0] = ((double)raw[i] / UINT8_MAX);
-        buf[i][1] = ((double)raw[i + 1] / UINT8_MAX);
+// True for the strides the int16 kernel handles: one, two or four channels.
+static inline bool int16_sse2_stride(size_t stride) {
+    return stride == 4 || stride == 8 || stride == 16;
+}
+
+// Four int16 samples, stride bytes apart, picked out of the other channels'
+// samples in between. With two channels, every other 32 bit lane of two loads
+// is ours; with four, the first lane of each of four loads is.
+static inline __m128i load_int16x4(const uint8_t *p, size_t stride) {
+    if (stride == 4) {
+        return _mm_loadu_si128((const __m128i *)p);
+    }
+    if (stride == 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, 0x08),
+                                  _mm_shuffle_epi32(b, 0x08));
     }
-    free(raw);
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(p + 48));
+    return _mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b),
+                              _mm_unpacklo_epi32(c, d));
 }
 
-void read_samples_int16(FILE *fp, fftw_complex *buf, uint32_t n) {
-    int16_t *raw = (int16_t *)malloc(n * 2 * sizeof(int16_t));
-    fread(raw, 4, n, fp);
-    for (uint32_t i = 0; i < n; i++) {
-        buf[i][0] = ((double)raw[i * 2] / INT16_MAX);
-        buf[i][1] = ((double)raw[(i * 2) + 1] / INT16_MAX);
+// Four int16 samples at a time, stride bytes apart (see int16_sse2_stride()),
+// optionally byte swapped. Returns how many samples were converted. With
+// several channels, the loads run past the last sample, so stop one short.
+static uint32_t convert_int16_sse2(const uint8_t *p, size_t stride,
+                                   fftw_complex *buf, uint32_t n, bool swap) {
+    const __m128d scale = _mm_set1_pd(INT16_MAX);
+    uint32_t end = (stride == 4) ? 4 : 5;
+    uint32_t i = 0;
+    for (; i + end <= n; i += 4) {
+        __m128i v = load_int16x4(p + (i * stride), stride);
+        if (swap) {
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        }
+        store_int16x8(v, buf[i], scale);
     }
-    free(raw);
+    return i;
 }
 
-void read_samples_uint16(FILE *fp, fftw_complex *buf, uint32_t n) {
-    uint16_t *raw = (uint16_t *)malloc(n * 2 * sizeof(uint16_t));
-    fread(raw, 4, n, fp);
-    for (uint32_t i = 0; i < n; i++) {
-        buf[i][0] = ((double)raw[i * 2] / UINT16_MAX);
-        buf[i][1] = ((double)raw[(i * 2) + 1] / UINT16_MAX);
+// Sixteen contiguous sc4 samples (16 bytes) at a time. Each byte is doubled
+// up into a 16 bit lane, which puts I in the top nibble and Q in the one
+// below it, to be shifted up and sign extended down from the top.
+static uint32_t convert_sc4_sse2(const uint8_t *p, fftw_complex *buf,
+                                 uint32_t n) {
+    const __m128d scale = _mm_set1_pd(SC4_MAX);
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lo = _mm_unpacklo_epi8(v, v);
+        __m128i hi = _mm_unpackhi_epi8(v, v);
+        __m128i re = _mm_srai_epi16(lo, 12);
+        __m128i im = _mm_srai_epi16(_mm_slli_epi16(lo, 4), 12);
+        store_int16x8(_mm_unpacklo_epi16(re, im), buf[i], scale);
+        store_int16x8(_mm_unpackhi_epi16(re, im), buf[i + 4], scale);
+        re = _mm_srai_epi16(hi, 12);
+        im = _mm_srai_epi16(_mm_slli_epi16(hi, 4), 12);
+        store_int16x8(_mm_unpacklo_epi16(re, im), buf[i + 8], scale);
+        store_int16x8(_mm_unpackhi_epi16(re, im), buf[i + 12], scale);
     }
-    free(raw);
+    return i;
 }
 
-void read_samples_int32(FILE *fp, fftw_complex *buf, uint32_t n) {
-    int32_t *raw = (int32_t *)malloc(n * 2 * sizeof(int32_t));
-    fread(raw, 4, n, fp);
-    for (uint32_t i = 0; i < n; i++) {
-        buf[i][0] = ((double)raw[i * 2] / INT32_MAX);
-        buf[i][1] = ((double)raw[(i * 2) + 1] / INT32_MAX);
+// Four contiguous sc12 samples (12 bytes) at a time. Each 16 bit lane gets the
+// two bytes holding one value, then I is sign extended from the bottom 12
+// bits and Q from the top 12. Loads 16 bytes, so stops two samples short of
+// the end of the buffer.
+__attribute__((target("ssse3"))) static uint32_t
+convert_sc12_ssse3(const uint8_t *p, fftw_complex *buf, uint32_t n) {
+    const __m128d scale = _mm_set1_pd(SC12_MAX);
+    const __m128i shuffle =
+        _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i even = _mm_set1_epi32(0x0000ffff);
+    uint32_t i = 0;
+    for (; i + 6 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + (i * 3)));
+        v = _mm_shuffle_epi8(v, shuffle);
+        __m128i re = _mm_srai_epi16(_mm_slli_epi16(v, 4), 4);
+        __m128i im = _mm_srai_epi16(v, 4);
+        v = _mm_or_si128(_mm_and_si128(even, re), _mm_andnot_si128(even, im));
+        store_int16x8(v, buf[i], scale);
     }
-    free(raw);
+    return i;
 }
 
-void read_samples_uint32(FILE *fp, fftw_complex *buf, uint32_t n) {
-    uint32_t *raw = (uint32_t *)malloc(n * 2 * sizeof(uint32_t));
-    fread(raw, 4, n, fp);
-    for (uint32_t i = 0; i < n; i++) {
-        buf[i][0] = ((double)raw[i * 2] / UINT32_MAX);
-        buf[i][1] = ((double)raw[(i * 2) + 1] / UINT32_MAX);
+// True if the SSSE3 kernels can run here.
+static bool have_ssse3(void) {
+#ifdef __SSSE3__
+    return true;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+void convert_samples_int16(const void *raw, size_t stride, fftw_complex *buf,
+                           uint32_t n) {
+    const uint8_t *p = (const uint8_t *)raw;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    if (int16_sse2_stride(stride)) {
+        i = convert_int16_sse2(p, stride, buf, n, false);
+    }
+#endif
+    for (; i < n; i++) {
+        int16_t v[2];
+        memcpy(v, p + (i * stride), sizeof(v));
+        buf[i][0] = ((double)v[0] / INT16_MAX);
+        buf[i][1] = ((double)v[1] / INT16_MAX);
     }
-    free(raw);
 }
 
-void read_samples_float32(FILE *fp, fftw_complex *buf, uint32_t n) {
-    size_t sample_size = 2 * sizeof(float);
-    float *raw = (float *)malloc(n * sample_size);
-    fread(raw, sample_size, n, fp);
+void convert_samples_int16be(const void *raw, size_t stride,
+                             fftw_complex *buf, uint32_t n) {
+    const uint8_t *p = (const uint8_t *)raw;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    if (int16_sse2_stride(stride)) {
+        i = convert_int16_sse2(p, stride, buf, n, true);
+    }
+#endif
+    for (; i < n; i++) {
+        uint16_t w[2];
+        memcpy(w, p + (i * stride), sizeof(w));
+        buf[i][0] = ((double)(int16_t)__builtin_bswap16(w[0]) / INT16_MAX);
+        buf[i][1] = ((double)(int16_t)__builtin_bswap16(w[1]) / INT16_MAX);
+    }
+}
+
+void convert_samples_float64(const void *raw, size_t stride,
+                             fftw_complex *buf, uint32_t n) {
+    if (stride == sizeof(fftw_complex)) {
+        memcpy(buf, raw, n * sizeof(fftw_complex));
+        return;
+    }
+    const uint8_t *p = (const uint8_t *)raw;
     for (uint32_t i = 0; i < n; i++) {
-        buf[i][0] = (double)raw[i * 2];
-        buf[i][1] = (double)raw[(i * 2) + 1];
+        memcpy(buf[i], p + (i * stride), sizeof(fftw_complex));
+    }
+}
+
+void convert_samples_sc12(const void *raw, size_t stride, fftw_complex *buf,
+                          uint32_t n) {
+    const uint8_t *p = (const uint8_t *)raw;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    if (stride == 3 && have_ssse3()) {
+        i = convert_sc12_ssse3(p, buf, n);
+    }
+#endif
+    for (; i < n; i++) {
+        const uint8_t *s = p + (i * stride);
+        uint32_t w = s[0] | (s[1] << 8) | ((uint32_t)s[2] << 16);
+        // Shift each value to the top of the word, then back down again to
+        // sign extend it.
+        int32_t re = (int32_t)(w << 20) >> 20;
+        int32_t im = (int32_t)(w << 8) >> 20;
+        buf[i][0] = ((double)re / SC12_MAX);
+        buf[i][1] = ((double)im / SC12_MAX);
     }
-    free(raw);
 }
 
-void read_samples_float64(FILE *fp, fftw_complex *buf, uint32_t n) {
-    size_t sample_size = 2 * sizeof(double);
-    fread(buf, sample_size, n, fp);
+void convert_samples_sc4(const void *raw, size_t stride, fftw_complex *buf,
+                         uint32_t n) {
+    const uint8_t *p = (const uint8_t *)raw;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    if (stride == 1) {
+        i = convert_sc4_sse2(p, buf, n);
+    }
+#endif
+    for (; i < n; i++) {
+        int8_t b = (int8_t)p[i * stride];
+        int8_t re = b >> 4;
+        int8_t im = (int8_t)(b << 4) >> 4;
+        buf[i][0] = ((double)re / SC4_MAX);
+        buf[i][1] = ((double)im / SC4_MAX);
+    }
+}
+
+int parse_format(format_t *result, const char *arg) {
+    if (!strcmp(arg, "uint8")) {
+        *result = FORMAT_UINT8;
+    } else if (!strcmp(arg, "int8")) {
+        *result = FORMAT_INT8;
+    } else if (!strcmp(arg, "uint16")) {
+        *result = FORMAT_UINT16;
+    } else if (!strcmp(arg, "int16")) {
+        *result = FORMAT_INT16;
+    } else if (!strcmp(arg, "uint32")) {
+        *result = FORMAT_UINT32;
+    } else if (!strcmp(arg, "int32")) {
+        *result = FORMAT_INT32;
+    } else if (!strcmp(arg, "float32")) {
+        *result = FORMAT_FLOAT32;
+    } else if (!strcmp(arg, "float64")) {
+        *result = FORMAT_FLOAT64;
+    } else if (!strcmp(arg, "sc12")) {
+        *result = FORMAT_SC12;
+    } else if (!strcmp(arg, "sc4")) {
+        *result = FORMAT_SC4;
+    } else if (!strcmp(arg, "int16be")) {
+        *result = FORMAT_INT16BE;
+    } else if (!strcmp(arg, "uint16be")) {
+        *result = FORMAT_UINT16BE;
+    } else if (!strcmp(arg, "int32be")) {
+        *result = FORMAT_INT32BE;
+    } else if (!strcmp(arg, "uint32be")) {
+        *result = FORMAT_UINT32BE;
+    } else if (!strcmp(arg, "float32be")) {
+        *result = FORMAT_FLOAT32BE;
+    } else if (!strcmp(arg, "float64be")) {
+        *result = FORMAT_FLOAT64BE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+size_t format_sample_size(format_t fmt) {
+    switch (fmt) {
+    case FORMAT_INT8:
+        return sizeof(int8_t) * 2;
+    case FORMAT_UINT8:
+        return sizeof(uint8_t) * 2;
+    case FORMAT_INT16:
+    case FORMAT_INT16BE:
+        return sizeof(int16_t) * 2;
+    case FORMAT_UINT16:
+    case FORMAT_UINT16BE:
+        return sizeof(uint16_t) * 2;
+    case FORMAT_INT32:
+    case FORMAT_INT32BE:
+        return sizeof(int32_t) * 2;
+    case FORMAT_UINT32:
+    case FORMAT_UINT32BE:
+        return sizeof(uint32_t) * 2;
+    case FORMAT_FLOAT32:
+    case FORMAT_FLOAT32BE:
+        return sizeof(float) * 2;
+    case FORMAT_FLOAT64:
+    case FORMAT_FLOAT64BE:
+        return sizeof(double) * 2;
+    case FORMAT_SC12:
+        return 3;
+    case FORMAT_SC4:
+        return 1;
+    }
+    return 0;
+}
+
+convert_samples_fn format_converter(format_t fmt) {
+    switch (fmt) {
+    case FORMAT_INT8:
+        return convert_samples_int8;
+    case FORMAT_UINT8:
+        return convert_samples_uint8;
+    case FORMAT_INT16:
+        return convert_samples_int16;
+    case FORMAT_UINT16:
+        return convert_samples_uint16;
+    case FORMAT_INT32:
+        return convert_samples_int32;
+    case FORMAT_UINT32:
+        return convert_samples_uint32;
+    case FORMAT_FLOAT32:
+        return convert_samples_float32;
+    case FORMAT_FLOAT64:
+        return convert_samples_float64;
+    case FORMAT_SC12:
+        return convert_samples_sc12;
+    case FORMAT_SC4:
+        return convert_samples_sc4;
+    case FORMAT_INT16BE:
+        return convert_samples_int16be;
+    case FORMAT_UINT16BE:
+        return convert_samples_uint16be;
+    case FORMAT_INT32BE:
+        return convert_samples_int32be;
+    case FORMAT_UINT32BE:
+        return convert_samples_uint32be;
+    case FORMAT_FLOAT32BE:
+        return convert_samples_float32be;
+    case FORMAT_FLOAT64BE:
+        return convert_samples_float64be;
+    }
+    return NULL;
 }
@@ -14,15 +14,62 @@ typedef enum {
     FORMAT_UINT32 = 5,
     FORMAT_FLOAT32 = 6,
     FORMAT_FLOAT64 = 7,
+    // Packed 12-bit signed I/Q, 3 bytes per sample: the little-endian 24-bit
+    // word holds I in bits 0-11 and Q in bits 12-23.
+    FORMAT_SC12 = 8,
+    // Packed 4-bit signed I/Q, 1 byte per sample: I in the high nibble, Q in
+    // the low nibble.
+    FORMAT_SC4 = 9,
+    // Big-endian variants of the plain formats.
+    FORMAT_INT16BE = 10,
+    FORMAT_UINT16BE = 11,
+    FORMAT_INT32BE = 12,
+    FORMAT_UINT32BE = 13,
+    FORMAT_FLOAT32BE = 14,
+    FORMAT_FLOAT64BE = 15,
 } format_t;
 
-typedef void (*read_samples_fn)(FILE *fp, fftw_complex *buf, uint32_t n);
+// Convert n complex samples from raw into buf, taking every sample stride
+// bytes apart, which de-interleaves one channel of a multi-channel stream.
+// raw does not need to be aligned.
+typedef void (*convert_samples_fn)(const void *raw, size_t stride,
+                                   fftw_complex *buf, uint32_t n);
 
-void read_samples_int8(FILE *fp, fftw_complex *buf, uint32_t n);
-void read_samples_uint8(FILE *fp, fftw_complex *buf, uint32_t n);
-void read_samples_int16(FILE *fp, fftw_complex *buf, uint32_t n);
-void read_samples_uint16(FILE *fp, fftw_complex *buf, uint32_t n);
-void read_samples_int32(FILE *fp, fftw_complex *buf, uint32_t n);
-void read_samples_uint32(FILE *fp, fftw_complex *buf, uint32_t n);
-void read_samples_float32(FILE *fp, fftw_complex *buf, uint32_t n);
-void read_samples_float64(FILE *fp, fftw_complex *buf, uint32_t n);
+void convert_samples_int8(const void *raw, size_t stride,
+                          fftw_complex *buf, uint32_t n);
+void convert_samples_uint8(const void *raw, size_t stride,
+                           fftw_complex *buf, uint32_t n);
+void convert_samples_int16(const void *raw, size_t stride,
+                           fftw_complex *buf, uint32_t n);
+void convert_samples_uint16(const void *raw, size_t stride,
+                            fftw_complex *buf, uint32_t n);
+void convert_samples_int32(const void *raw, size_t stride,
+                           fftw_complex *buf, uint32_t n);
+void convert_samples_uint32(const void *raw, size_t stride,
+                            fftw_complex *buf, uint32_t n);
+void convert_samples_float32(const void *raw, size_t stride,
+                             fftw_complex *buf, uint32_t n);
+void convert_samples_float64(const void *raw, size_t stride,
+                             fftw_complex *buf, uint32_t n);
+void convert_samples_sc12(const void *raw, size_t stride, fftw_complex *buf,
+                          uint32_t n);
+void convert_samples_sc4(const void *raw, size_t stride, fftw_complex *buf,
+                         uint32_t n);
+void convert_samples_int16be(const void *raw, size_t stride,
+                             fftw_complex *buf, uint32_t n);
+void convert_samples_uint16be(const void *raw, size_t stride,
+                              fftw_complex *buf, uint32_t n);
+void convert_samples_int32be(const void *raw, size_t stride,
+                             fftw_complex *buf, uint32_t n);
+void convert_samples_uint32be(const void *raw, size_t stride,
+                              fftw_complex *buf, uint32_t n);
+void convert_samples_float32be(const void *raw, size_t stride,
+                               fftw_complex *buf, uint32_t n);
+void convert_samples_float64be(const void *raw, size_t stride,
+                               fftw_complex *buf, uint32_t n);
+
+int parse_format(format_t *result, const char *arg);
+
+// Size in bytes of one complex sample.
+size_t format_sample_size(format_t fmt);
+convert_samples_fn format_converter(format_t fmt);
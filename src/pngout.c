@@ -0,0 +1,178 @@
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <png.h>
+
+#include "arena.h"
+#include "pngout.h"
+
+// What libpng allocates for itself besides its row buffers, the bulk of which
+// is zlib's deflate state (256K at the default settings).
+#define PNG_OUT_OVERHEAD (512 << 10)
+
+// Row buffers libpng allocates: the row, the previous row, and one for each
+// filter it tries.
+#define PNG_OUT_ROWS 8
+
+// Report the error and unwind to the setjmp() of whoever called libpng, so
+// that one bad image doesn't take the rest of the process down with it.
+static void png_out_error(png_structp png_ptr, png_const_charp msg) {
+    fprintf(stderr, "Error: libpng error: %s\n", msg);
+    png_longjmp(png_ptr, 1);
+}
+
+// libpng and zlib allocate everything up front, and hold on to it until the
+// image is done, so an arena can take the place of the heap. Anything that
+// doesn't fit comes from the heap after all.
+static png_voidp png_arena_malloc(png_structp png_ptr, png_alloc_size_t size) {
+    arena_t *arena = (arena_t *)png_get_mem_ptr(png_ptr);
+    void *p = arena_alloc(arena, size);
+    return p ? p : malloc(size);
+}
+
+static void png_arena_free(png_structp png_ptr, png_voidp ptr) {
+    arena_t *arena = (arena_t *)png_get_mem_ptr(png_ptr);
+    if (!arena_owns(arena, ptr))
+        free(ptr);
+}
+
+size_t png_out_memory(uint32_t width) {
+    return PNG_OUT_OVERHEAD +
+           PNG_OUT_ROWS * arena_footprint(((size_t)width * 3) + 1);
+}
+
+int png_out_open(png_out_t *out, const char *path, uint32_t width,
+                 uint32_t height, arena_t *arena) {
+    out->failed = false;
+    out->fp = fopen(path, "wb");
+    if (!out->fp) {
+        fprintf(stderr, "Error: failed to write to %s.\n", path);
+        return -1;
+    }
+
+    if (arena) {
+        out->png_ptr = png_create_write_struct_2(
+            PNG_LIBPNG_VER_STRING, NULL, png_out_error, NULL, arena,
+            png_arena_malloc, png_arena_free);
+    } else {
+        out->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                               png_out_error, NULL);
+    }
+    if (!out->png_ptr) {
+        fprintf(stderr, "Error: could not initialize write struct.\n");
+        fclose(out->fp);
+        return -1;
+    }
+
+    out->info_ptr = png_create_info_struct(out->png_ptr);
+    if (!out->info_ptr) {
+        fprintf(stderr, "Error: could not initialize info struct.\n");
+        png_destroy_write_struct(&out->png_ptr, NULL);
+        fclose(out->fp);
+        return -1;
+    }
+
+    if (setjmp(png_jmpbuf(out->png_ptr))) {
+        png_destroy_write_struct(&out->png_ptr, &out->info_ptr);
+        fclose(out->fp);
+        return -1;
+    }
+    png_set_user_limits(out->png_ptr, 0x7fffffffL, 0x7fffffffL);
+
+    png_init_io(out->png_ptr, out->fp);
+    png_set_IHDR(out->png_ptr, out->info_ptr, width, height, 8,
+                 PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_write_info(out->png_ptr, out->info_ptr);
+    return 0;
+}
+
+void png_out_write_row(png_out_t *out, const uint8_t *row) {
+    if (out->failed)
+        return;
+    if (setjmp(png_jmpbuf(out->png_ptr))) {
+        out->failed = true;
+        return;
+    }
+    png_write_row(out->png_ptr, (png_const_bytep)row);
+}
+
+int png_out_close(png_out_t *out) {
+    if (!out->failed) {
+        if (setjmp(png_jmpbuf(out->png_ptr))) {
+            out->failed = true;
+        } else {
+            png_write_end(out->png_ptr, NULL);
+        }
+    }
+    png_free_data(out->png_ptr, out->info_ptr, PNG_FREE_ALL, -1);
+    png_destroy_write_struct(&out->png_ptr, &out->info_ptr);
+    if (fclose(out->fp) != 0 && !out->failed) {
+        fprintf(stderr, "Error: failed to write image.\n");
+        out->failed = true;
+    }
+    return out->failed ? -1 : 0;
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} png_buffer_t;
+
+static void png_buffer_write(png_structp png_ptr, png_bytep data,
+                             png_size_t len) {
+    png_buffer_t *buf = (png_buffer_t *)png_get_io_ptr(png_ptr);
+    if (buf->len + len > buf->cap) {
+        while (buf->len + len > buf->cap)
+            buf->cap *= 2;
+        uint8_t *data = (uint8_t *)realloc(buf->data, buf->cap);
+        if (!data)
+            png_error(png_ptr, "out of memory");
+        buf->data = data;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void png_buffer_flush(png_structp png_ptr) {
+    (void)png_ptr;
+}
+
+int png_encode(const uint8_t *rgb, uint32_t width, uint32_t height,
+               uint8_t **data, size_t *len) {
+    png_buffer_t buf;
+    buf.cap = 4096 + (size_t)width * height;
+    buf.data = (uint8_t *)malloc(buf.cap);
+    buf.len = 0;
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                                  png_out_error, NULL);
+    png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+    if (!buf.data || !info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(buf.data);
+        return -1;
+    }
+
+    png_set_write_fn(png_ptr, &buf, png_buffer_write, png_buffer_flush);
+    // Tiles are encoded while someone waits on them.
+    png_set_compression_level(png_ptr, 1);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+    png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+                 PNG_FILTER_TYPE_BASE);
+    png_write_info(png_ptr, info_ptr);
+    for (uint32_t y = 0; y < height; y++) {
+        png_write_row(png_ptr, (png_const_bytep)(rgb + ((size_t)y * width * 3)));
+    }
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    *data = buf.data;
+    *len = buf.len;
+    return 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <png.h>
+
+#include "arena.h"
+
+// A PNG file being written row by row. libpng errors are reported on stderr,
+// and fail just this image: rows after one are dropped, and closing it
+// returns the error.
+typedef struct {
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    bool failed;
+} png_out_t;
+
+// Create path and write the header of a width x height RGB image, with
+// libpng's buffers out of arena if there is one. Returns -1 (after reporting
+// why on stderr) on failure.
+int png_out_open(png_out_t *out, const char *path, uint32_t width,
+                 uint32_t height, arena_t *arena);
+
+// Bytes (at most) an image width pixels wide takes out of its arena.
+size_t png_out_memory(uint32_t width);
+
+void png_out_write_row(png_out_t *out, const uint8_t *row);
+
+// Write the footer and close the file. Returns -1 if the image couldn't be
+// written (reported on stderr when it happened).
+int png_out_close(png_out_t *out);
+
+// Encode a width x height RGB image in memory, favoring speed over size. Sets
+// *data to a buffer to free() when done, and *len to its length. Returns -1
+// (after reporting why on stderr) on failure.
+int png_encode(const uint8_t *rgb, uint32_t width, uint32_t height,
+               uint8_t **data, size_t *len);
@@ -0,0 +1,189 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "affinity.h"
+#include "pool.h"
+
+typedef struct {
+    pool_task_fn fn;
+    void *arg;
+} task_t;
+
+typedef struct {
+    pool_t *pool;
+    uint32_t index;
+    placement_t placement;
+    pthread_t thread;
+
+    // Ring of queued tasks. The condition is signaled when there is space.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    task_t *tasks;
+    uint32_t head;
+    uint32_t count;
+} pool_worker_t;
+
+struct pool {
+    uint32_t nthreads;
+    uint32_t queue_size;
+    pool_worker_t *workers;
+
+    // Tasks queued on all workers, which idle workers wait on. Only changed
+    // with the lock of the queue the task is on held too.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t pending;
+    // Workers that have moved to their placement.
+    uint32_t started;
+    // Tasks ever submitted, so that workers waiting on tasks queued on other
+    // nodes can tell when there's something new.
+    uint64_t submitted;
+    bool stop;
+};
+
+// Take the oldest task queued on w, if any.
+static bool take_task(pool_t *pool, pool_worker_t *w, task_t *task) {
+    pthread_mutex_lock(&w->lock);
+    bool found = (w->count > 0);
+    if (found) {
+        *task = w->tasks[w->head];
+        w->head = (w->head + 1) % pool->queue_size;
+        w->count--;
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+        // Wake up anybody waiting for space in the queue.
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static void *worker_main(void *arg) {
+    pool_worker_t *w = (pool_worker_t *)arg;
+    pool_t *pool = w->pool;
+
+    w->placement = place_thread(w->placement);
+    pthread_mutex_lock(&pool->lock);
+    pool->started++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        bool done = (pool->pending == 0);
+        bool stop = pool->stop;
+        uint64_t seen = pool->submitted;
+        pthread_mutex_unlock(&pool->lock);
+        if (done) {
+            break;
+        }
+
+        // Our own tasks come first, since their buffers are next to us. Once
+        // those run out, steal from the other queues rather than sit idle,
+        // but only from workers on our node, so that the task's buffers are
+        // still local.
+        task_t task;
+        bool found = take_task(pool, w, &task);
+        for (uint32_t i = 1; !found && i < pool->nthreads; i++) {
+            pool_worker_t *victim =
+                &pool->workers[(w->index + i) % pool->nthreads];
+            if (victim->placement.node == w->placement.node)
+                found = take_task(pool, victim, &task);
+        }
+        if (found) {
+            task.fn(task.arg, w->index);
+        } else if (stop) {
+            // Everything left is on other nodes, and nothing more is coming.
+            break;
+        } else {
+            // Everything queued is on other nodes, so wait for more work
+            // rather than spin.
+            pthread_mutex_lock(&pool->lock);
+            while (pool->submitted == seen && !pool->stop) {
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+pool_t *pool_create(uint32_t nthreads, const placement_t *placement,
+                    uint32_t queue_size) {
+    pool_t *pool = (pool_t *)calloc(1, sizeof(pool_t));
+    pool->nthreads = nthreads;
+    pool->queue_size = queue_size;
+    pool->workers = (pool_worker_t *)calloc(nthreads, sizeof(pool_worker_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pool_worker_t *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        w->placement = placement[i];
+        w->tasks = (task_t *)malloc(queue_size * sizeof(task_t));
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        pthread_create(&w->thread, NULL, worker_main, w);
+    }
+
+    // Wait for the workers to be placed, so pool_placement() says where they
+    // really are.
+    pthread_mutex_lock(&pool->lock);
+    while (pool->started < nthreads) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pool;
+}
+
+void pool_submit(pool_t *pool, uint32_t worker, pool_task_fn fn, void *arg) {
+    pool_worker_t *w = &pool->workers[worker];
+    pthread_mutex_lock(&w->lock);
+    while (w->count == pool->queue_size) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    task_t *task = &w->tasks[(w->head + w->count) % pool->queue_size];
+    task->fn = fn;
+    task->arg = arg;
+    w->count++;
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pool->submitted++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+uint32_t pool_threads(const pool_t *pool) {
+    return pool->nthreads;
+}
+
+placement_t pool_placement(const pool_t *pool, uint32_t worker) {
+    return pool->workers[worker].placement;
+}
+
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->nthreads; i++) {
+        pool_worker_t *w = &pool->workers[i];
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        free(w->tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->workers);
+    free(pool);
+}
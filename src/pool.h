@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "affinity.h"
+
+// Runs on worker thread number worker.
+typedef void (*pool_task_fn)(void *arg, uint32_t worker);
+
+typedef struct pool pool_t;
+
+// Start nthreads workers, each moved to its placement before it runs any
+// tasks (or left unpinned if it can't be). Returns once they all have been.
+// Each worker has its own queue of up to queue_size tasks.
+pool_t *pool_create(uint32_t nthreads, const placement_t *placement,
+                    uint32_t queue_size);
+
+// Queue a task on a specific worker, so that it runs next to that worker's
+// buffers. Blocks while the worker's queue is full. Workers with nothing
+// queued of their own steal tasks from the others on the same NUMA node, so
+// tasks from several sources sharing a pool keep every worker busy without
+// taking buffers off their node.
+void pool_submit(pool_t *pool, uint32_t worker, pool_task_fn fn, void *arg);
+
+uint32_t pool_threads(const pool_t *pool);
+
+// Where a worker was placed, which may be unpinned if its placement
+// couldn't be applied.
+placement_t pool_placement(const pool_t *pool, uint32_t worker);
+
+// Runs any tasks still queued, then stops the workers.
+void pool_destroy(pool_t *pool);
@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "profile.h"
+
+#define PROFILE_MAGIC "renderfall-profile"
+#define PROFILE_VERSION 1
+
+bool profile_default_path(char *path, size_t size) {
+    const char *env = getenv("RENDERFALL_PROFILE");
+    if (env && *env) {
+        snprintf(path, size, "%s", env);
+        return true;
+    }
+    const char *config = getenv("XDG_CONFIG_HOME");
+    if (config && *config) {
+        snprintf(path, size, "%s/renderfall/profile", config);
+        return true;
+    }
+    const char *home = getenv("HOME");
+    if (home && *home) {
+        snprintf(path, size, "%s/.config/renderfall/profile", home);
+        return true;
+    }
+    return false;
+}
+
+int profile_load(profile_t *p, const char *path) {
+    memset(p, 0, sizeof(profile_t));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Error: failed to read %s.\n", path);
+        return -1;
+    }
+
+    char key[64], val[64];
+    int version = 0;
+    int ok = (fscanf(fp, "%63s %d", key, &version) == 2) &&
+             !strcmp(key, PROFILE_MAGIC) && (version == PROFILE_VERSION);
+
+    // Each entry starts with its FFT size.
+    profile_entry_t *e = NULL;
+    while (ok && fscanf(fp, "%63s %63s", key, val) == 2) {
+        if (!strcmp(key, "fftsize")) {
+            if (p->nentries == PROFILE_MAX_ENTRIES) {
+                ok = 0;
+                break;
+            }
+            e = &p->entries[p->nentries++];
+            e->fftsize = (uint32_t)strtoul(val, NULL, 10);
+            ok = (e->fftsize > 0);
+        } else if (!e) {
+            ok = 0;
+        } else if (!strcmp(key, "threads")) {
+            e->threads = (uint32_t)strtoul(val, NULL, 10);
+        } else if (!strcmp(key, "rows")) {
+            e->rows_per_block = (uint32_t)strtoul(val, NULL, 10);
+        } else if (!strcmp(key, "planner")) {
+            ok = (parse_planner(&e->planner, val) == 0);
+        } else if (!strcmp(key, "block")) {
+            e->block_size = (size_t)strtoull(val, NULL, 10);
+        } else if (!strcmp(key, "rate")) {
+            e->rate = strtod(val, NULL);
+        } else {
+            ok = 0;
+        }
+    }
+    fclose(fp);
+
+    if (!ok) {
+        fprintf(stderr, "Error: %s is not a valid profile.\n", path);
+        return -1;
+    }
+    return 1;
+}
+
+// mkdir -p for the directory path is in.
+static void make_parent(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+int profile_save(const profile_t *p, const char *path) {
+    make_parent(path);
+
+    // Write a new file and move it into place, so that renders starting in
+    // the meantime never see half a profile.
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: failed to write to %s.\n", tmp);
+        return -1;
+    }
+
+    fprintf(fp, "%s %d\n", PROFILE_MAGIC, PROFILE_VERSION);
+    for (uint32_t i = 0; i < p->nentries; i++) {
+        const profile_entry_t *e = &p->entries[i];
+        fprintf(fp,
+                "fftsize %" PRIu32 " threads %" PRIu32 " rows %" PRIu32
+                " planner %s block %zu rate %.4g\n",
+                e->fftsize, e->threads, e->rows_per_block,
+                planner_name(e->planner), e->block_size, e->rate);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: failed to write to %s.\n", path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void profile_set(profile_t *p, const profile_entry_t *entry) {
+    for (uint32_t i = 0; i < p->nentries; i++) {
+        if (p->entries[i].fftsize == entry->fftsize) {
+            p->entries[i] = *entry;
+            return;
+        }
+    }
+    if (p->nentries < PROFILE_MAX_ENTRIES) {
+        p->entries[p->nentries++] = *entry;
+    }
+}
+
+const profile_entry_t *profile_lookup(const profile_t *p, uint32_t fftsize) {
+    const profile_entry_t *best = NULL;
+    double best_dist = 0;
+    for (uint32_t i = 0; i < p->nentries; i++) {
+        // FFT sizes go up in powers of 2, so compare them that way.
+        double dist = fabs(log2((double)p->entries[i].fftsize / fftsize));
+        if (!best || dist < best_dist) {
+            best = &p->entries[i];
+            best_dist = dist;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "waterfall.h"
+
+// Most FFT sizes a profile holds.
+#define PROFILE_MAX_ENTRIES 32
+
+// The fastest settings renderfall tune found for one FFT size.
+typedef struct {
+    uint32_t fftsize;
+    uint32_t threads;
+    uint32_t rows_per_block;
+    planner_t planner;
+    size_t block_size;
+    // Samples per second the settings rendered at while tuning.
+    double rate;
+} profile_entry_t;
+
+// Settings tuned for this host, used for whatever the command line leaves
+// out. Kept as text, one FFT size per line.
+typedef struct {
+    profile_entry_t entries[PROFILE_MAX_ENTRIES];
+    uint32_t nentries;
+} profile_t;
+
+// Where the profile is kept: $RENDERFALL_PROFILE, or else renderfall/profile
+// in $XDG_CONFIG_HOME (or ~/.config). Returns false if there's nowhere to
+// keep it.
+bool profile_default_path(char *path, size_t size);
+
+// Returns 1 if the profile was loaded, 0 if there is none at path, or -1
+// (after reporting why on stderr) if it couldn't be read.
+int profile_load(profile_t *p, const char *path);
+
+// Replace the profile at path, creating its directory if need be. Returns -1
+// (after reporting why on stderr) on failure.
+int profile_save(const profile_t *p, const char *path);
+
+// Add an entry, replacing any for the same FFT size.
+void profile_set(profile_t *p, const profile_entry_t *entry);
+
+// The entry for the FFT size nearest fftsize, or NULL if there are none.
+const profile_entry_t *profile_lookup(const profile_t *p, uint32_t fftsize);
@@ -0,0 +1,247 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "affinity.h"
+#include "arena.h"
+#include "reader.h"
+
+// Blocks read ahead of the consumer.
+#define READ_BLOCKS 4
+
+// When this much of the current file is left, open the next one and ask the
+// kernel to start reading it.
+#define PREFETCH_BYTES (16 << 20)
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} block_t;
+
+struct reader {
+    char *const *paths;
+    uint32_t npaths;
+    uint64_t skip;
+    placement_t placement;
+    size_t block_size;
+    arena_t *arena;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Ring of blocks: filled by the reading thread, emptied in order by the
+    // consumer. The consumer holds on to one block (the one it was last
+    // given) until its next call.
+    block_t blocks[READ_BLOCKS];
+    uint32_t head;
+    uint32_t count;
+    bool holding;
+    bool eof;
+    bool failed;
+    bool stop;
+};
+
+int64_t reader_total_size(char *const *paths, uint32_t npaths) {
+    int64_t total = 0;
+    for (uint32_t i = 0; i < npaths; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) < 0) {
+            fprintf(stderr, "Failed to open input file: %s\n", paths[i]);
+            return -1;
+        }
+        total += st.st_size;
+    }
+    return total;
+}
+
+static FILE *open_input(reader_t *r, uint32_t i, uint64_t *size) {
+    FILE *fp = fopen(r->paths[i], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open input file: %s\n", r->paths[i]);
+        return NULL;
+    }
+    struct stat st;
+    fstat(fileno(fp), &st);
+    *size = st.st_size;
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fileno(fp), 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+    return fp;
+}
+
+// Wait for a free block, and return it.
+static block_t *next_free(reader_t *r) {
+    pthread_mutex_lock(&r->lock);
+    while (r->count + (r->holding ? 1 : 0) == READ_BLOCKS && !r->stop) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    uint32_t i = r->head + (r->holding ? 1 : 0) + r->count;
+    block_t *b = r->stop ? NULL : &r->blocks[i % READ_BLOCKS];
+    pthread_mutex_unlock(&r->lock);
+    return b;
+}
+
+static void publish(reader_t *r, bool eof, bool failed) {
+    pthread_mutex_lock(&r->lock);
+    if (!eof) {
+        r->count++;
+    }
+    r->eof = eof;
+    r->failed = failed;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *reader_main(void *arg) {
+    reader_t *r = (reader_t *)arg;
+    uint64_t skip = r->skip;
+    uint64_t size = 0, pos = 0;
+    uint32_t i = 0;
+
+    r->placement = place_thread(r->placement);
+
+    // Skip over whole files before opening anything.
+    FILE *fp = NULL, *next = NULL;
+    uint64_t next_size = 0;
+    for (; i < r->npaths; i++) {
+        if ((fp = open_input(r, i, &size)) == NULL) {
+            publish(r, true, true);
+            return NULL;
+        }
+        if (skip < size) {
+            fseek(fp, skip, SEEK_SET);
+            pos = skip;
+            break;
+        }
+        skip -= size;
+        fclose(fp);
+        fp = NULL;
+    }
+
+    block_t *b;
+    while (fp && (b = next_free(r)) != NULL) {
+        b->len = 0;
+        while (b->len < r->block_size && fp) {
+            size_t n =
+                fread(b->data + b->len, 1, r->block_size - b->len, fp);
+            if (n < r->block_size - b->len && ferror(fp)) {
+                fprintf(stderr, "Failed to read input file: %s\n",
+                        r->paths[i]);
+                fclose(fp);
+                if (next)
+                    fclose(next);
+                publish(r, true, true);
+                return NULL;
+            }
+            b->len += n;
+            pos += n;
+
+            // The file may have grown since it was opened, so pos can be
+            // past size.
+            if (next == NULL && (i + 1) < r->npaths &&
+                (pos >= size || (size - pos) <= PREFETCH_BYTES)) {
+                if ((next = open_input(r, i + 1, &next_size)) == NULL) {
+                    fclose(fp);
+                    publish(r, true, true);
+                    return NULL;
+                }
+            }
+
+            if (n == 0 || pos >= size) {
+                // Carry on into the next file in the same block, so the
+                // consumer never sees the boundary.
+                fclose(fp);
+                fp = next;
+                size = next_size;
+                pos = 0;
+                next = NULL;
+                i++;
+            }
+        }
+        if (b->len > 0) {
+            publish(r, false, false);
+        }
+    }
+
+    if (fp)
+        fclose(fp);
+    if (next)
+        fclose(next);
+    publish(r, true, false);
+    return NULL;
+}
+
+size_t reader_memory(size_t block_size) {
+    return READ_BLOCKS *
+           arena_footprint(block_size ? block_size : READ_BLOCK_SIZE);
+}
+
+reader_t *reader_open(char *const *paths, uint32_t npaths, uint64_t skip,
+                      placement_t placement, size_t block_size,
+                      arena_t *arena) {
+    reader_t *r = (reader_t *)calloc(1, sizeof(reader_t));
+    r->paths = paths;
+    r->npaths = npaths;
+    r->skip = skip;
+    r->placement = placement;
+    r->block_size = block_size ? block_size : READ_BLOCK_SIZE;
+    r->arena = arena;
+    for (uint32_t i = 0; i < READ_BLOCKS; i++) {
+        r->blocks[i].data =
+            arena ? (uint8_t *)arena_alloc(arena, r->block_size) : NULL;
+        if (!r->blocks[i].data)
+            r->blocks[i].data = (uint8_t *)malloc(r->block_size);
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    pthread_create(&r->thread, NULL, reader_main, r);
+    return r;
+}
+
+size_t reader_next(reader_t *r, const uint8_t **block) {
+    pthread_mutex_lock(&r->lock);
+    if (r->holding) {
+        // Done with the previous block.
+        r->head = (r->head + 1) % READ_BLOCKS;
+        r->holding = false;
+        pthread_cond_broadcast(&r->cond);
+    }
+    while (r->count == 0 && !r->eof) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    size_t len = 0;
+    if (r->count > 0) {
+        r->count--;
+        r->holding = true;
+        *block = r->blocks[r->head].data;
+        len = r->blocks[r->head].len;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return len;
+}
+
+bool reader_failed(reader_t *r) {
+    pthread_mutex_lock(&r->lock);
+    bool failed = r->failed;
+    pthread_mutex_unlock(&r->lock);
+    return failed;
+}
+
+void reader_close(reader_t *r) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    for (uint32_t i = 0; i < READ_BLOCKS; i++) {
+        if (!r->arena || !arena_owns(r->arena, r->blocks[i].data))
+            free(r->blocks[i].data);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r);
+}
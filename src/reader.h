@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "affinity.h"
+#include "arena.h"
+
+// Bytes per block handed to the consumer (the last one may be shorter),
+// unless the reader is given a size.
+#define READ_BLOCK_SIZE (1 << 20)
+
+// Reads a sequence of files as one continuous byte stream, on its own thread,
+// a few blocks ahead of the consumer. The next file is opened and prefetched
+// before the current one runs out, so there's no stall at file boundaries.
+typedef struct reader reader_t;
+
+// Total size of the files in paths. Returns -1 (and reports the file on
+// stderr) if any of them can't be read.
+int64_t reader_total_size(char *const *paths, uint32_t npaths);
+
+// Start reading paths in order, skip bytes into the stream, in blocks of
+// block_size bytes (0 for READ_BLOCK_SIZE). The reading thread is moved to
+// placement. With an arena, the blocks come out of it.
+reader_t *reader_open(char *const *paths, uint32_t npaths, uint64_t skip,
+                      placement_t placement, size_t block_size,
+                      arena_t *arena);
+
+// Bytes a reader with blocks of block_size takes out of its arena.
+size_t reader_memory(size_t block_size);
+
+// Wait for the next block of the stream. Returns its length, or 0 at the end
+// of the stream. The block stays valid until the next call.
+size_t reader_next(reader_t *r, const uint8_t **block);
+
+// True if the stream ended early because a file couldn't be opened or read.
+bool reader_failed(reader_t *r);
+
+void reader_close(reader_t *r);
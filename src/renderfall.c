@@ -26,8 +26,11 @@
 // - Do an array of string constants / int constants for things like formats,
 // window functions, etc.
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
-#include <float.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -36,20 +39,154 @@
 #include <string.h>
 
 #include <getopt.h>
-#include <png.h>
+#include <glob.h>
+#include <pthread.h>
 
+#include "affinity.h"
+#include "arena.h"
 #include "colormap.h"
+#include "ddc.h"
+#include "detect.h"
+#include "fanout.h"
 #include "formats.h"
+#include "pngout.h"
+#include "profile.h"
+#include "reader.h"
+#include "rotate.h"
+#include "rowqueue.h"
+#include "serve.h"
+#include "shell.h"
+#include "sidecar.h"
+#include "spectrum.h"
+#include "tune.h"
 #include "waterfall.h"
-#include "window.h"
+
+// Most CPUs accepted by --cpus.
+#define MAX_CPUS 1024
+
+// Most channels accepted by --channels.
+#define MAX_CHANNELS 64
+
+// Most filterbank taps per branch accepted by --taps.
+#define MAX_TAPS 64
+
+// Most --spec options accepted.
+#define MAX_SPECS 16
+
+// Tasks queued per pool worker in --batch mode.
+#define BATCH_QUEUE_SIZE 4
+
+// Tasks queued per pool worker for each --spec.
+#define SPEC_QUEUE_SIZE 2
+
+// Default --landscape-memory, in MB.
+#define DEFAULT_LANDSCAPE_MEMORY 512
+
+// Largest --block-size, in KB.
+#define MAX_BLOCK_KB (1 << 20)
+
+typedef struct {
+    // One image, or one per channel.
+    png_out_t images[MAX_CHANNELS];
+    // For landscape output, where each image's rows go to be turned on their
+    // side before they're written.
+    rotator_t *rotators[MAX_CHANNELS];
+    uint32_t nimages;
+    // Bytes per image row.
+    size_t stride;
+    uint32_t frames;
+    // Only one output reports progress.
+    bool progress;
+} png_output_t;
+
+// Detected events, written out as CSV or (for a .json path) a JSON array.
+typedef struct {
+    FILE *fp;
+    bool json;
+    uint64_t count;
+} events_output_t;
+
+void write_event(void *userdata, const detect_event_t *ev) {
+    events_output_t *out = (events_output_t *)userdata;
+    if (out->json) {
+        fprintf(out->fp,
+                "%s\n  {\"channel\": %d, \"start_frame\": %" PRIu64
+                ", \"end_frame\": %" PRIu64 ", \"low_bin\": %d, "
+                "\"high_bin\": %d, \"peak_db\": %.2f}",
+                out->count ? "," : "", ev->channel, ev->start_frame,
+                ev->end_frame, ev->low_bin, ev->high_bin, ev->peak_db);
+    } else {
+        fprintf(out->fp, "%d,%" PRIu64 ",%" PRIu64 ",%d,%d,%.2f\n",
+                ev->channel, ev->start_frame, ev->end_frame, ev->low_bin,
+                ev->high_bin, ev->peak_db);
+    }
+    out->count++;
+}
+
+// One of the renders made from the input, as given by --spec.
+typedef struct {
+    waterfall_params_t params;
+    char window[255];
+    char outfile[PATH_MAX];
+    png_output_t out;
+    // With several specs, where the render's rows go to be encoded on a
+    // thread of their own.
+    rowqueue_t *queue;
+    waterfall_t *wf;
+} render_spec_t;
+
+void write_png_rows(void *userdata, uint32_t y, uint32_t nrows,
+                    const uint8_t *rows) {
+    png_output_t *out = (png_output_t *)userdata;
+    for (uint32_t i = 0; i < nrows; i++) {
+        const uint8_t *row = rows + (i * out->stride * out->nimages);
+        for (uint32_t j = 0; j < out->nimages; j++) {
+            if (out->rotators[j])
+                rotator_write_row(out->rotators[j], row + (j * out->stride));
+            else
+                png_out_write_row(&out->images[j], row + (j * out->stride));
+        }
+        if (out->progress)
+            update_progress(y + i, out->frames);
+    }
+}
+
+void write_rotated_row(void *userdata, const uint8_t *row) {
+    png_out_write_row((png_out_t *)userdata, row);
+}
+
+// Output path for one strip of an incremental render: foo.png becomes
+// foo.0003.png.
+void strip_path(char *dest, size_t size, const char *outfile, uint32_t n) {
+    size_t len = strlen(outfile);
+    if (len > 4 && !strcmp(outfile + len - 4, ".png")) {
+        snprintf(dest, size, "%.*s.%04d.png", (int)(len - 4), outfile, n);
+    } else {
+        snprintf(dest, size, "%s.%04d.png", outfile, n);
+    }
+}
+
+// Output path for one channel: foo.png becomes foo.ch0.png.
+void channel_path(char *dest, size_t size, const char *outfile, uint32_t c) {
+    size_t len = strlen(outfile);
+    if (len > 4 && !strcmp(outfile + len - 4, ".png")) {
+        snprintf(dest, size, "%.*s.ch%d.png", (int)(len - 4), outfile, c);
+    } else {
+        snprintf(dest, size, "%s.ch%d.png", outfile, c);
+    }
+}
 
 void usage(char *arg) {
-    fprintf(stderr, "Usage: %s [OPTIONS] <in>\n", arg);
-    fprintf(stderr, "Render a waterfall spectrum from raw IQ samples.\n\n");
+    fprintf(stderr, "Usage: %s [OPTIONS] <in> [<in>...]\n", arg);
+    fprintf(stderr, "       %s serve [OPTIONS] <spectrum>\n", arg);
+    fprintf(stderr, "       %s tune [OPTIONS]\n", arg);
+    fprintf(stderr, "Render a waterfall spectrum from raw IQ samples.\n");
+    fprintf(stderr, "Several inputs (or quoted glob patterns) are rendered "
+                    "as one continuous stream.\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -n, --fftsize <fftsize>\tFFT size (power of 2)\n");
     fprintf(stderr, "  -f, --format  <format>\tInput format: uint8, int16, "
-                    "float64, etc.\n");
+                    "float64, sc12, int16be, etc.\n");
     fprintf(stderr, "  -w, --window  <window>\tWindowing function: hann, "
                     "gaussian, square, blackmanharris, hamming, kaiser, "
                     "parzen\n");
@@ -57,75 +194,70 @@ void usage(char *arg) {
                     "<infile>.png)\n");
     fprintf(stderr,
             "  -s, --offset  <offset>\tStart at specified byte offset\n");
+    fprintf(stderr, "      --taps <taps>\tUse a polyphase filterbank with "
+                    "N taps per branch, shaped by the window (defaults to 1, "
+                    "a plain window)\n");
     fprintf(stderr, "  -l, --overlap <overlap>\tOverlap N samples per frame "
                     "(defaults to 0)\n");
     fprintf(
         stderr,
         "  -c, --clip <clip>\tRead only the first N samples from the file\n");
+    fprintf(stderr, "  -r, --rate <rate>\tInput sample rate in Hz (defaults "
+                    "to 1, i.e. normalized frequencies)\n");
+    fprintf(stderr, "      --center <freq>\tZoom in on a sub-band centered "
+                    "at this offset from the capture center\n");
+    fprintf(stderr, "      --bandwidth <bw>\tWidth of the sub-band to zoom "
+                    "in on\n");
+    fprintf(stderr, "      --channels <n>\tInput has N channels interleaved "
+                    "sample by sample (defaults to 1)\n");
+    fprintf(stderr, "      --split-channels\tWrite each channel to its own "
+                    "image instead of side by side\n");
+    fprintf(stderr, "      --spec <spec>\tAdd a render of the same input, "
+                    "e.g. fftsize=512,window=hann,overlap=256,taps=4,"
+                    "outfile=a.png (repeatable)\n");
+    fprintf(stderr, "      --append \t\tOnly render input added since the "
+                    "last --append run, to a new strip\n");
+    fprintf(stderr, "      --detect <file>\tWrite energy detections to a "
+                    "CSV file (or JSON, for a .json file)\n");
+    fprintf(stderr, "      --threshold <dB>\tDetection level above the "
+                    "noise floor (defaults to 10)\n");
+    fprintf(stderr, "      --batch <manifest>\tRender every job in a manifest "
+                    "of <in> <out> [<spec>] lines, sharing the threads\n");
+    fprintf(stderr, "      --spectrum <file>\tAlso write the power of every "
+                    "bin to a spectral cache, for renderfall serve\n");
+    fprintf(stderr, "      --landscape \tPut time on the x axis instead "
+                    "of the y axis\n");
+    fprintf(stderr, "      --landscape-memory <MB>\tMemory to use for "
+                    "--landscape before spilling to $TMPDIR (defaults to "
+                    "512)\n");
+    fprintf(stderr, "      --memory-limit <MB>\tAllocate every buffer up front "
+                    "within this limit, or fail if they don't fit\n");
+    fprintf(stderr, "      --huge-pages \tPut the --memory-limit buffers on "
+                    "huge pages\n");
+    fprintf(stderr, "  -t, --threads <n>\tRender on N worker threads "
+                    "(defaults to 0, render on the reading thread)\n");
+    fprintf(stderr, "      --cpus <list>\tPin worker threads to these CPUs, "
+                    "e.g. 0-7,16-23\n");
+    fprintf(stderr, "      --numa \t\tSpread workers over NUMA nodes with "
+                    "node-local buffers\n");
+    fprintf(stderr, "      --rows-per-batch <n>\tRender N frames per batch "
+                    "(defaults to 16 when threaded)\n");
+    fprintf(stderr, "      --planner <planner>\tFFT planning effort: "
+                    "estimate, measure, patient or exhaustive (defaults to "
+                    "patient)\n");
+    fprintf(stderr, "      --block-size <KB>\tRead the input in blocks of "
+                    "this size (defaults to 1024)\n");
+    fprintf(stderr, "      --profile <file>\tTake the settings above, where "
+                    "not given, from this renderfall tune profile\n");
+    fprintf(stderr, "      --no-profile \tIgnore the renderfall tune "
+                    "profile\n");
     fprintf(stderr, "  -v, --verbose \t\tPrint verbose debugging output\n");
 }
 
-int parse_format(format_t *result, char *arg) {
-    if (!strcmp(arg, "uint8")) {
-        *result = FORMAT_UINT8;
-    } else if (!strcmp(arg, "int8")) {
-        *result = FORMAT_INT8;
-    } else if (!strcmp(arg, "uint16")) {
-        *result = FORMAT_UINT16;
-    } else if (!strcmp(arg, "int16")) {
-        *result = FORMAT_INT16;
-    } else if (!strcmp(arg, "uint32")) {
-        *result = FORMAT_UINT32;
-    } else if (!strcmp(arg, "int32")) {
-        *result = FORMAT_INT32;
-    } else if (!strcmp(arg, "float32")) {
-        *result = FORMAT_FLOAT32;
-    } else if (!strcmp(arg, "float64")) {
-        *result = FORMAT_FLOAT64;
-    } else {
-        return -1;
-    }
-    return 0;
-}
-
-static double beta = 0;
-
-int prepare_window(window_t *win, char *arg, uint32_t w, bool verbose) {
-    if (!strcmp(arg, "hann")) {
-        if (verbose)
-            printf("Using a Hann window of size %d.\n", w);
-        *win = make_window_hann(w);
-    } else if (!strcmp(arg, "gaussian")) {
-        double beta = 8.00;
-        if (verbose)
-            printf("Using a Gaussian window of size %d, beta %0.3f\n", w, beta);
-        *win = make_window_gaussian(w, beta);
-    } else if (!strcmp(arg, "square")) {
-        if (verbose)
-            printf("Using a square window of size %d.\n", w);
-        *win = make_window_square(w);
-    } else if (!strcmp(arg, "blackman")) {
-        if (verbose)
-            printf("Using a Blackman window of size %d.\n", w);
-        *win = make_window_blackman(w);
-    } else if (!strcmp(arg, "blackmanharris")) {
-        *win = make_window_blackman_harris(w);
-    } else if (!strcmp(arg, "hamming")) {
-        *win = make_window_hamming(w);
-    } else if (!strcmp(arg, "kaiser")) {
-        *win = make_window_kaiser(w, beta);
-    } else if (!strcmp(arg, "parzen")) {
-        *win = make_window_parzen(w);
-    } else {
-        return -1;
-    }
-    return 0;
-}
-
 bool parse_int64_t(char *arg, int64_t *dest) {
     char *end = NULL;
     int64_t val;
-    if (optarg == NULL || ((val = strtol(arg, &end, 0)), (end && *end))) {
+    if (arg == NULL || ((val = strtol(arg, &end, 0)), (end && *end))) {
         return false;
     }
     *dest = val;
@@ -157,7 +289,7 @@ bool parse_uint32_t(char *arg, uint32_t *dest) {
 bool parse_double(char *arg, double *dest) {
     char *end = NULL;
     double val;
-    if (optarg == NULL || ((val = strtod(arg, &end)), (end && *end))) {
+    if (arg == NULL || ((val = strtod(arg, &end)), (end && *end))) {
         return false;
     }
     *dest = val;
@@ -168,26 +300,461 @@ bool is_power_of_2(uint32_t n) {
     return (n & (n - 1)) == 0;
 }
 
+// Apply a --spec argument, a comma separated list of key=value settings, on
+// top of the settings already in spec.
+bool parse_spec(render_spec_t *spec, char *arg) {
+    char *save = NULL;
+    for (char *tok = strtok_r(arg, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if (!val) {
+            fprintf(stderr, "Invalid spec setting: %s\n", tok);
+            return false;
+        }
+        *val++ = '\0';
+        if (!strcmp(tok, "fftsize")) {
+            if (!parse_uint32_t(val, &spec->params.fftsize) ||
+                !is_power_of_2(spec->params.fftsize)) {
+                fprintf(stderr, "Invalid fftsize (must be power of 2): %s\n",
+                        val);
+                return false;
+            }
+        } else if (!strcmp(tok, "overlap")) {
+            if (!parse_uint32_t(val, &spec->params.overlap)) {
+                fprintf(stderr, "Invalid overlap: %s\n", val);
+                return false;
+            }
+        } else if (!strcmp(tok, "taps")) {
+            if (!parse_uint32_t(val, &spec->params.taps) ||
+                spec->params.taps > MAX_TAPS) {
+                fprintf(stderr, "Invalid taps: %s\n", val);
+                return false;
+            }
+        } else if (!strcmp(tok, "beta")) {
+            if (!parse_double(val, &spec->params.beta)) {
+                fprintf(stderr, "Invalid value for beta\n");
+                return false;
+            }
+        } else if (!strcmp(tok, "window")) {
+            snprintf(spec->window, sizeof(spec->window), "%s", val);
+        } else if (!strcmp(tok, "outfile")) {
+            snprintf(spec->outfile, sizeof(spec->outfile), "%s", val);
+        } else {
+            fprintf(stderr, "Unknown spec setting: %s\n", tok);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Which of the settings renderfall tune picks were given on the command line,
+// and so aren't taken from the profile.
+typedef struct {
+    bool threads;
+    bool rows_per_block;
+    bool planner;
+    bool block_size;
+} tuned_given_t;
+
+// Take the settings the command line left out from the profile entry for
+// the FFT size nearest p's. Threads are only taken with threads set, as
+// they're shared by every spec. Returns the entry used, if any.
+const profile_entry_t *apply_profile(waterfall_params_t *p,
+                                     const profile_t *profile,
+                                     const tuned_given_t *given,
+                                     bool threads) {
+    const profile_entry_t *e =
+        profile ? profile_lookup(profile, p->fftsize) : NULL;
+    if (!e)
+        return NULL;
+    if (threads && !given->threads)
+        p->threads = e->threads;
+    if (!given->rows_per_block)
+        p->rows_per_block = e->rows_per_block;
+    if (!given->planner)
+        p->planner = e->planner;
+    return e;
+}
+
+int compare_versions(const void *a, const void *b) {
+    return strverscmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Expand glob patterns among the input arguments, for lists of captures too
+// long for the shell. Matches are sorted by version, so that numbered files
+// come out in sequence even without zero padding.
+char **expand_inputs(char **args, int nargs, uint32_t *npaths) {
+    char **paths = NULL;
+    uint32_t n = 0;
+
+    for (int i = 0; i < nargs; i++) {
+        glob_t g;
+        if (strpbrk(args[i], "*?[") &&
+            glob(args[i], GLOB_NOSORT, NULL, &g) == 0) {
+            paths = (char **)realloc(paths, (n + g.gl_pathc) * sizeof(char *));
+            for (size_t j = 0; j < g.gl_pathc; j++) {
+                paths[n + j] = strdup(g.gl_pathv[j]);
+            }
+            qsort(paths + n, g.gl_pathc, sizeof(char *), compare_versions);
+            n += g.gl_pathc;
+            globfree(&g);
+        } else {
+            paths = (char **)realloc(paths, (n + 1) * sizeof(char *));
+            paths[n++] = strdup(args[i]);
+        }
+    }
+
+    *npaths = n;
+    return paths;
+}
+
+// One line of a --batch manifest: an input, where its image goes, and
+// optionally settings for it in the same form as --spec.
+typedef struct {
+    char infile[PATH_MAX];
+    render_spec_t spec;
+    bool failed;
+} batch_job_t;
+
+typedef struct {
+    batch_job_t *jobs;
+    uint32_t njobs;
+    // Next job to start.
+    uint32_t next;
+    pthread_mutex_t lock;
+    bool split_channels;
+    bool verbose;
+    // Tuned settings for each job's FFT size, if any.
+    const profile_t *profile;
+    const tuned_given_t *given;
+    size_t block_size;
+} batch_t;
+
+// Read a manifest, with every job starting from params. Returns NULL (after
+// reporting why on stderr) if it can't be read or a line is invalid.
+batch_job_t *load_manifest(const char *path, const waterfall_params_t *params,
+                           uint32_t *njobs) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: failed to read %s.\n", path);
+        return NULL;
+    }
+
+    batch_job_t *jobs = NULL;
+    uint32_t n = 0;
+    char line[3 * PATH_MAX];
+    for (uint32_t lineno = 1; fgets(line, sizeof(line), fp); lineno++) {
+        char *save = NULL;
+        char *in = strtok_r(line, " \t\r\n", &save);
+        if (!in || in[0] == '#') {
+            continue;
+        }
+        char *out = strtok_r(NULL, " \t\r\n", &save);
+        char *settings = strtok_r(NULL, " \t\r\n", &save);
+        if (!out || strtok_r(NULL, " \t\r\n", &save)) {
+            fprintf(stderr, "%s:%d: expected <in> <out> [<spec>]\n", path,
+                    lineno);
+            free(jobs);
+            fclose(fp);
+            return NULL;
+        }
+
+        jobs = (batch_job_t *)realloc(jobs, (n + 1) * sizeof(batch_job_t));
+        batch_job_t *job = &jobs[n++];
+        memset(job, 0, sizeof(batch_job_t));
+        snprintf(job->infile, sizeof(job->infile), "%s", in);
+        render_spec_t *spec = &job->spec;
+        spec->params = *params;
+        snprintf(spec->window, sizeof(spec->window), "%s", params->window);
+        snprintf(spec->outfile, sizeof(spec->outfile), "%s", out);
+        if ((settings && !parse_spec(spec, settings)) ||
+            spec->params.overlap >= spec->params.fftsize) {
+            fprintf(stderr, "%s:%d: invalid settings for %s\n", path, lineno,
+                    in);
+            free(jobs);
+            fclose(fp);
+            return NULL;
+        }
+    }
+    fclose(fp);
+
+    *njobs = n;
+    return jobs;
+}
+
+// Render one job to its image. Returns false (after reporting why on stderr)
+// on failure.
+bool run_job(batch_t *b, batch_job_t *job) {
+    render_spec_t *spec = &job->spec;
+    waterfall_params_t *p = &spec->params;
+    p->window = spec->window;
+    apply_profile(p, b->profile, b->given, false);
+    uint32_t channels = (p->channels > 0) ? p->channels : 1;
+
+    char *paths[1] = {job->infile};
+    int64_t size = reader_total_size(paths, 1);
+    if (size < 0) {
+        return false;
+    }
+    size_t stride = format_sample_size(p->format) * channels;
+    uint64_t left = (size / stride) * stride;
+
+    png_output_t *out = &spec->out;
+    out->nimages = b->split_channels ? channels : 1;
+    out->stride = 3 * p->fftsize * (channels / out->nimages);
+    out->frames = waterfall_rows(p, size / stride);
+    if (out->frames == 0) {
+        fprintf(stderr, "Error: %s is too short for a single row.\n",
+                job->infile);
+        return false;
+    }
+
+    spec->wf = waterfall_create(p, write_png_rows, out);
+    if (!spec->wf) {
+        fprintf(stderr, "Unknown window function: %s\n", spec->window);
+        return false;
+    }
+    uint32_t opened = 0;
+    for (; opened < out->nimages; opened++) {
+        char path[PATH_MAX];
+        if (b->split_channels)
+            channel_path(path, sizeof(path), spec->outfile, opened);
+        else
+            strcpy(path, spec->outfile);
+        if (png_out_open(&out->images[opened], path,
+                         (uint32_t)(out->stride / 3), out->frames, NULL) < 0) {
+            break;
+        }
+    }
+
+    bool ok = (opened == out->nimages);
+    if (ok) {
+        placement_t anywhere = {-1, -1};
+        reader_t *reader = reader_open(paths, 1, 0, anywhere,
+                                       b->block_size, NULL);
+        const uint8_t *block;
+        size_t len;
+        while (left > 0 && (len = reader_next(reader, &block)) > 0) {
+            if (len > left)
+                len = left;
+            left -= len;
+            if (!waterfall_push(spec->wf, block, len)) {
+                break;
+            }
+        }
+        waterfall_finish(spec->wf);
+        ok = !reader_failed(reader);
+        reader_close(reader);
+    }
+
+    for (uint32_t j = 0; j < opened; j++) {
+        if (png_out_close(&out->images[j]) < 0)
+            ok = false;
+    }
+    waterfall_destroy(spec->wf);
+    spec->wf = NULL;
+    return ok;
+}
+
+// Takes jobs off the manifest until there are none left. Several of these run
+// at once, their renders all feeding the same pool.
+void *batch_runner(void *arg) {
+    batch_t *b = (batch_t *)arg;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        uint32_t i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->njobs) {
+            break;
+        }
+        batch_job_t *job = &b->jobs[i];
+        job->failed = !run_job(b, job);
+        if (b->verbose)
+            printf("%s: %s -> %s\n", job->failed ? "Failed" : "Rendered",
+                   job->infile, job->spec.outfile);
+    }
+    return NULL;
+}
+
+// Render every job in a manifest in this one process. With threads, the jobs
+// share a single pool: as many jobs as there are workers are read at once,
+// so short inputs render side by side, and each job's frames are spread
+// over every worker, so a long one doesn't hold things up. Plans and windows
+// are made once per setting and shared by all the jobs (see
+// waterfall_create()).
+int run_batch(const char *manifest, waterfall_params_t *params,
+              bool split_channels, bool verbose, const profile_t *profile,
+              const tuned_given_t *given, size_t block_size) {
+    batch_t b;
+    memset(&b, 0, sizeof(b));
+    b.split_channels = split_channels;
+    b.verbose = verbose;
+    b.profile = profile;
+    b.given = given;
+    b.block_size = block_size;
+    b.jobs = load_manifest(manifest, params, &b.njobs);
+    if (!b.jobs) {
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&b.lock, NULL);
+
+    uint32_t nrunners = 1;
+    pool_t *pool = NULL;
+    placement_t *placement = NULL;
+    if (params->threads > 0) {
+        placement =
+            (placement_t *)malloc(params->threads * sizeof(placement_t));
+        plan_placement(placement, params->threads, params->cpus,
+                       params->ncpus, params->numa);
+        pool = pool_create(params->threads, placement, BATCH_QUEUE_SIZE);
+        for (uint32_t i = 0; i < b.njobs; i++) {
+            b.jobs[i].spec.params.pool = pool;
+        }
+        nrunners = (b.njobs < params->threads) ? b.njobs : params->threads;
+    }
+    if (verbose)
+        printf("Rendering %d jobs, %d at a time...\n", b.njobs, nrunners);
+
+    if (nrunners <= 1) {
+        batch_runner(&b);
+    } else {
+        pthread_t *runners = (pthread_t *)malloc(nrunners * sizeof(pthread_t));
+        for (uint32_t i = 0; i < nrunners; i++) {
+            pthread_create(&runners[i], NULL, batch_runner, &b);
+        }
+        for (uint32_t i = 0; i < nrunners; i++) {
+            pthread_join(runners[i], NULL);
+        }
+        free(runners);
+    }
+
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < b.njobs; i++) {
+        if (b.jobs[i].failed)
+            failed++;
+    }
+    if (failed > 0)
+        fprintf(stderr, "%d of %d jobs failed.\n", failed, b.njobs);
+
+    if (pool)
+        pool_destroy(pool);
+    free(placement);
+    pthread_mutex_destroy(&b.lock);
+    free(b.jobs);
+    waterfall_cleanup();
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Bytes of buffers a render of nsamples samples of input in format takes out
+// of its arena: those of each spec's render, images and rotators (given a
+// --landscape budget to share) and, with several specs, row queues, and of
+// the detector, spectral cache, fanout and reader (reading blocks of
+// block_size).
+size_t render_memory(const render_spec_t *specs, uint32_t nspecs,
+                     format_t format, uint64_t nsamples, size_t block_size,
+                     size_t landscape_budget, bool detect, bool spectrum) {
+    const waterfall_params_t *first = &specs[0].params;
+    uint32_t channels = (first->channels > 0) ? first->channels : 1;
+    size_t size = reader_memory(block_size);
+    if (nspecs > 1)
+        size += fanout_memory(format, channels, block_size);
+    if (detect)
+        size += detector_memory(first->fftsize, channels);
+    if (spectrum) {
+        spectrum_info_t info;
+        spectrum_info_init(&info, first->fftsize, channels,
+                           waterfall_rows(first, nsamples));
+        size += spectrum_writer_memory(&info);
+    }
+
+    for (uint32_t i = 0; i < nspecs; i++) {
+        const png_output_t *out = &specs[i].out;
+        size += waterfall_memory(&specs[i].params,
+                                 i == 0 && (detect || spectrum));
+        if (nspecs > 1)
+            size += rowqueue_memory(out->stride * out->nimages);
+        uint32_t width = (uint32_t)(out->stride / 3);
+        uint32_t frames = waterfall_rows(&specs[i].params, nsamples);
+        size_t budget = landscape_budget / (nspecs * out->nimages);
+        for (uint32_t j = 0; j < out->nimages; j++) {
+            if (landscape_budget > 0) {
+                size += png_out_memory(frames) +
+                        rotator_memory(width, frames, budget);
+            } else {
+                size += png_out_memory(width);
+            }
+        }
+    }
+    return size;
+}
+
 int main(int argc, char *argv[]) {
-    char infile[255];
+    if (argc > 1 && !strcmp(argv[1], "serve")) {
+        argv[1] = argv[0];
+        return serve_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "tune")) {
+        argv[1] = argv[0];
+        return tune_main(argc - 1, argv + 1);
+    }
+
     char outfile[255] = "";
-    char fmt_s[255];
+    char fmt_s[255] = "float32";
     char window_s[255] = "blackman";
+    char detect_s[PATH_MAX] = "";
+    char spectrum_s[PATH_MAX] = "";
+    char batch_s[PATH_MAX] = "";
+    char profile_s[PATH_MAX] = "";
 
     // Default args.
-    format_t fmt = FORMAT_FLOAT32;
     int verbose = 0;
+    int numa = 0;
+    int split_channels = 0;
+    int append = 0;
+    int landscape = 0;
+    uint64_t landscape_memory = 0;
+    uint64_t memory_limit = 0;
+    int huge_pages = 0;
+    int no_profile = 0;
+    uint64_t block_kb = 0;
+    tuned_given_t given = {false, false, false, false};
     uint64_t skip = 0;
+    int cpus[MAX_CPUS];
+    char *spec_args[MAX_SPECS];
+    uint32_t nspec_args = 0;
 
     waterfall_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.format = FORMAT_FLOAT32;
+    params.window = window_s;
     params.overlap = 0;
     params.fftsize = 2048;
     params.clip = 0;
 
+    detect_params_t detect;
+    detect.threshold = DETECT_DEFAULT_THRESHOLD;
+    detect.hysteresis = DETECT_DEFAULT_HYSTERESIS;
+    detect.alpha = DETECT_DEFAULT_ALPHA;
+    detect.min_frames = DETECT_DEFAULT_MIN_FRAMES;
+
+    double rate = 1.0;
+    double center = 0.0;
+    double bandwidth = 0.0;
+
     int c;
     struct option long_options[] = {/*These options set a flag.*/
                                     {"verbose", no_argument, &verbose, 1},
                                     {"brief", no_argument, &verbose, 0},
+                                    {"numa", no_argument, &numa, 1},
+                                    {"split-channels", no_argument,
+                                     &split_channels, 1},
+                                    {"append", no_argument, &append, 1},
+                                    {"landscape", no_argument, &landscape,
+                                     1},
+                                    {"huge-pages", no_argument, &huge_pages,
+                                     1},
+                                    {"no-profile", no_argument, &no_profile,
+                                     1},
                                     /*These options don’t set a flag.*/
                                     /*We distinguish them by their indices.*/
                                     {"help", no_argument, NULL, 'h'},
@@ -197,14 +764,40 @@ int main(int argc, char *argv[]) {
                                     {"outfile", required_argument, NULL, 'o'},
                                     {"offset", required_argument, NULL, 's'},
                                     {"overlap", required_argument, NULL, 'l'},
+                                    {"taps", required_argument, NULL, 'L'},
                                     {"clip", required_argument, NULL, 'c'},
                                     {"beta", required_argument, NULL, 'b'},
+                                    {"rate", required_argument, NULL, 'r'},
+                                    {"center", required_argument, NULL, 'C'},
+                                    {"bandwidth", required_argument, NULL,
+                                     'B'},
+                                    {"threads", required_argument, NULL, 't'},
+                                    {"channels", required_argument, NULL,
+                                     'N'},
+                                    {"cpus", required_argument, NULL, 'P'},
+                                    {"spec", required_argument, NULL, 'S'},
+                                    {"detect", required_argument, NULL, 'D'},
+                                    {"landscape-memory", required_argument,
+                                     NULL, 'M'},
+                                    {"threshold", required_argument, NULL,
+                                     'T'},
+                                    {"spectrum", required_argument, NULL,
+                                     'Y'},
+                                    {"batch", required_argument, NULL, 'J'},
+                                    {"memory-limit", required_argument, NULL,
+                                     'X'},
+                                    {"rows-per-batch", required_argument,
+                                     NULL, 'R'},
+                                    {"planner", required_argument, NULL, 'G'},
+                                    {"block-size", required_argument, NULL,
+                                     'K'},
+                                    {"profile", required_argument, NULL, 'F'},
                                     {0, 0, 0, 0}
 
     };
 
     int option_index;
-    while ((c = getopt_long(argc, argv, "hvf:n:o:s:w:l:c:", long_options,
+    while ((c = getopt_long(argc, argv, "hvf:n:o:s:w:l:c:r:t:", long_options,
                             &option_index)) != -1) {
         switch (c) {
         case 0:
@@ -233,9 +826,16 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
             break;
+        case 'L':
+            if (!parse_uint32_t(optarg, &(params.taps)) ||
+                params.taps > MAX_TAPS) {
+                fprintf(stderr, "Invalid taps: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'f':
             strcpy(fmt_s, optarg);
-            if (parse_format(&fmt, fmt_s) < 0) {
+            if (parse_format(&params.format, fmt_s) < 0) {
                 fprintf(stderr, "Unknown format: %s\n", optarg);
                 return EXIT_FAILURE;
             }
@@ -253,7 +853,7 @@ int main(int argc, char *argv[]) {
             }
             break;
         case 'b':
-            if (!parse_double(optarg, &beta)) {
+            if (!parse_double(optarg, &params.beta)) {
                 fprintf(stderr, "Invalid value for beta\n");
                 return EXIT_FAILURE;
             }
@@ -264,6 +864,110 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
             break;
+        case 'r':
+            if (!parse_double(optarg, &rate) || rate <= 0) {
+                fprintf(stderr, "Invalid value for rate\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            if (!parse_double(optarg, &center)) {
+                fprintf(stderr, "Invalid value for center\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            if (!parse_double(optarg, &bandwidth) || bandwidth <= 0) {
+                fprintf(stderr, "Invalid value for bandwidth\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'N':
+            if (!parse_uint32_t(optarg, &(params.channels)) ||
+                params.channels == 0 || params.channels > MAX_CHANNELS) {
+                fprintf(stderr, "Invalid value for channels\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (!parse_uint32_t(optarg, &(params.threads))) {
+                fprintf(stderr, "Invalid value for threads\n");
+                return EXIT_FAILURE;
+            }
+            given.threads = true;
+            break;
+        case 'R':
+            if (!parse_uint32_t(optarg, &(params.rows_per_block))) {
+                fprintf(stderr, "Invalid value for rows per batch\n");
+                return EXIT_FAILURE;
+            }
+            given.rows_per_block = true;
+            break;
+        case 'G':
+            if (parse_planner(&params.planner, optarg) < 0) {
+                fprintf(stderr, "Unknown planner: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            given.planner = true;
+            break;
+        case 'K':
+            if (!parse_uint64_t(optarg, &block_kb) || block_kb == 0 ||
+                block_kb > MAX_BLOCK_KB) {
+                fprintf(stderr, "Invalid value for block size\n");
+                return EXIT_FAILURE;
+            }
+            given.block_size = true;
+            break;
+        case 'F':
+            snprintf(profile_s, sizeof(profile_s), "%s", optarg);
+            break;
+        case 'P': {
+            int n = parse_cpu_list(optarg, cpus, MAX_CPUS);
+            if (n <= 0) {
+                fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            params.cpus = cpus;
+            params.ncpus = n;
+            break;
+        }
+        case 'M':
+            if (!parse_uint64_t(optarg, &landscape_memory) ||
+                landscape_memory == 0) {
+                fprintf(stderr, "Invalid value for landscape memory\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'X':
+            if (!parse_uint64_t(optarg, &memory_limit) || memory_limit == 0) {
+                fprintf(stderr, "Invalid value for memory limit\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            snprintf(detect_s, sizeof(detect_s), "%s", optarg);
+            break;
+        case 'J':
+            snprintf(batch_s, sizeof(batch_s), "%s", optarg);
+            break;
+        case 'Y':
+            snprintf(spectrum_s, sizeof(spectrum_s), "%s", optarg);
+            break;
+        case 'T':
+            if (!parse_double(optarg, &detect.threshold) ||
+                detect.threshold <= 0) {
+                fprintf(stderr, "Invalid value for threshold\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            if (nspec_args == MAX_SPECS) {
+                fprintf(stderr, "At most %d specs are supported.\n",
+                        MAX_SPECS);
+                return EXIT_FAILURE;
+            }
+            spec_args[nspec_args++] = optarg;
+            break;
         case '?':
             if (optopt == 'c')
                 fprintf(stderr, "Option -%c requires an argument.\n", optopt);
@@ -279,157 +983,581 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if ((argc - optind) > 1) {
-        fprintf(stderr, "Excess arguments.\n");
-        usage(argv[0]);
+    bool batch = strcmp(batch_s, "");
+    if (batch && ((argc - optind) > 0 || strcmp(outfile, "") ||
+                  nspec_args > 0 || append || landscape ||
+                  strcmp(detect_s, "") || strcmp(spectrum_s, ""))) {
+        fprintf(stderr, "--batch takes its inputs and outputs from the "
+                        "manifest, and can't be combined with -o, --spec, "
+                        "--append, --detect, --spectrum or --landscape.\n");
+        return EXIT_FAILURE;
+    }
+    if (batch && memory_limit > 0) {
+        fprintf(stderr, "--memory-limit can't be used with --batch.\n");
         return EXIT_FAILURE;
-    } else if ((argc - optind) < 1) {
+    }
+    if (huge_pages && memory_limit == 0) {
+        fprintf(stderr, "--huge-pages requires --memory-limit.\n");
+        return EXIT_FAILURE;
+    }
+    if (no_profile && strcmp(profile_s, "")) {
+        fprintf(stderr, "--profile can't be used with --no-profile.\n");
+        return EXIT_FAILURE;
+    }
+    if (!batch && (argc - optind) < 1) {
         fprintf(stderr, "Must supply an input filename.\n");
         usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    window_t win;
-    if (prepare_window(&win, window_s, params.fftsize, verbose) < 0) {
-        fprintf(stderr, "Unknown window function: %s", window_s);
+    if (bandwidth > 0) {
+        if (bandwidth > rate || fabs(center) > (rate / 2)) {
+            fprintf(stderr, "Sub-band of %f Hz at %f Hz does not fit in a "
+                            "sample rate of %f Hz.\n",
+                    bandwidth, center, rate);
+            return EXIT_FAILURE;
+        }
+        params.center = center / rate;
+        params.bandwidth = bandwidth / rate;
+    } else if (center != 0) {
+        fprintf(stderr, "A center frequency requires a bandwidth.\n");
         return EXIT_FAILURE;
     }
-    params.win = win;
 
-    if (verbose)
-        printf("Opening input file...\n");
+    if (append && bandwidth > 0) {
+        fprintf(stderr, "--append can't be used with a sub-band.\n");
+        return EXIT_FAILURE;
+    }
+    if (strcmp(detect_s, "") && nspec_args > 1) {
+        fprintf(stderr, "--detect takes a single --spec.\n");
+        return EXIT_FAILURE;
+    }
+    if (strcmp(spectrum_s, "") && nspec_args > 1) {
+        fprintf(stderr, "--spectrum takes a single --spec.\n");
+        return EXIT_FAILURE;
+    }
+    if (strcmp(spectrum_s, "") && append) {
+        fprintf(stderr, "--spectrum can't be used with --append.\n");
+        return EXIT_FAILURE;
+    }
+    // The detector's noise floors and open events aren't saved with the rest
+    // of the state, so a resumed run couldn't carry on where the last left off.
+    if (strcmp(detect_s, "") && append) {
+        fprintf(stderr, "--detect can't be used with --append.\n");
+        return EXIT_FAILURE;
+    }
+    if (append && nspec_args > 1) {
+        fprintf(stderr, "--append takes a single --spec.\n");
+        return EXIT_FAILURE;
+    }
+
+    params.numa = numa;
+    if (numa && !numa_supported()) {
+        fprintf(stderr, "Warning: NUMA is not available, ignoring --numa.\n");
+    }
+
+    // Settings left out of the command line come from the profile written by
+    // renderfall tune, if there is one. One named with --profile must exist.
+    profile_t profile_data;
+    const profile_t *profile = NULL;
+    if (!no_profile) {
+        bool named = strcmp(profile_s, "");
+        if (named || profile_default_path(profile_s, sizeof(profile_s))) {
+            int loaded = profile_load(&profile_data, profile_s);
+            if (loaded < 0) {
+                return EXIT_FAILURE;
+            }
+            if (loaded == 0 && named) {
+                fprintf(stderr, "Error: failed to read %s.\n", profile_s);
+                return EXIT_FAILURE;
+            }
+            if (loaded > 0)
+                profile = &profile_data;
+        }
+    }
+
+    // Threads and the block size are shared by every spec, so they're tuned
+    // for the first one (or the command line's, for --batch).
+    size_t block_size = block_kb << 10;
+    waterfall_params_t first = params;
+    if (!batch && nspec_args > 0) {
+        render_spec_t probe;
+        memset(&probe, 0, sizeof(probe));
+        probe.params = params;
+        char arg[PATH_MAX];
+        snprintf(arg, sizeof(arg), "%s", spec_args[0]);
+        if (parse_spec(&probe, arg))
+            first = probe.params;
+    }
+    const profile_entry_t *tuned =
+        apply_profile(&first, profile, &given, true);
+    if (tuned) {
+        params.threads = first.threads;
+        if (!given.block_size)
+            block_size = tuned->block_size;
+        if (verbose)
+            printf("Using settings tuned for FFT size %d from %s.\n",
+                   tuned->fftsize, profile_s);
+    }
+    if (block_size == 0)
+        block_size = READ_BLOCK_SIZE;
+
+    if (batch) {
+        return run_batch(batch_s, &params, split_channels, verbose, profile,
+                         &given, block_size);
+    }
 
-    strcpy(infile, argv[optind]);
+    uint32_t channels = (params.channels > 0) ? params.channels : 1;
 
-    FILE *readfp = fopen(infile, "rb");
-    if (readfp == NULL) {
-        fprintf(stderr, "Failed to open input file: %s\n", infile);
+    // Every spec starts from the settings given on the command line. With
+    // several of them, the input is converted once and the converted samples
+    // fanned out to each render.
+    uint32_t nspecs = (nspec_args > 0) ? nspec_args : 1;
+    if (nspecs > 1 && strcmp(outfile, "")) {
+        fprintf(stderr, "Use outfile= in each --spec instead of -o.\n");
         return EXIT_FAILURE;
     }
+    render_spec_t *specs =
+        (render_spec_t *)calloc(nspecs, sizeof(render_spec_t));
+    for (uint32_t i = 0; i < nspecs; i++) {
+        render_spec_t *spec = &specs[i];
+        spec->params = params;
+        strcpy(spec->window, window_s);
+        if (nspecs == 1)
+            strcpy(spec->outfile, outfile);
+        if (nspec_args > 0 && !parse_spec(spec, spec_args[i])) {
+            return EXIT_FAILURE;
+        }
+        spec->params.window = spec->window;
+        apply_profile(&spec->params, profile, &given, false);
+        if (nspecs > 1)
+            spec->params.format = FORMAT_FLOAT64;
+
+        if (spec->params.overlap >= spec->params.fftsize) {
+            fprintf(stderr,
+                    "Overlap of %d must be less than FFT frame size of %d.\n",
+                    spec->params.overlap, spec->params.fftsize);
+            return EXIT_FAILURE;
+        }
 
-    fseek(readfp, 0, SEEK_END);
-    size_t size = ftell(readfp);
-    fseek(readfp, skip, SEEK_SET);
-
-    size_t sample_size;
-    read_samples_fn reader;
-    switch (fmt) {
-    case FORMAT_INT8:
-        sample_size = sizeof(int8_t) * 2;
-        reader = read_samples_int8;
-        break;
-    case FORMAT_UINT8:
-        sample_size = sizeof(uint8_t) * 2;
-        reader = read_samples_uint8;
-        break;
-    case FORMAT_INT16:
-        sample_size = sizeof(int16_t) * 2;
-        reader = read_samples_int16;
-        break;
-    case FORMAT_UINT16:
-        sample_size = sizeof(uint16_t) * 2;
-        reader = read_samples_uint16;
-        break;
-    case FORMAT_INT32:
-        sample_size = sizeof(int32_t) * 2;
-        reader = read_samples_int32;
-        break;
-    case FORMAT_UINT32:
-        sample_size = sizeof(uint32_t) * 2;
-        reader = read_samples_uint32;
-        break;
-    case FORMAT_FLOAT32:
-        sample_size = sizeof(float) * 2;
-        reader = read_samples_float32;
-        break;
-    case FORMAT_FLOAT64:
-        sample_size = sizeof(double) * 2;
-        reader = read_samples_float64;
-        break;
-    }
-    params.reader = reader;
-
-    uint64_t nsamples = size / sample_size;
-    if ((params.clip > 0) && (nsamples > params.clip)) {
-        nsamples = params.clip;
-    }
-
-    if (params.overlap > params.fftsize) {
-        fprintf(stderr, "Overlap of %d is greater than FFT frame size of %d.\n",
-                params.overlap, params.fftsize);
+        png_output_t *out = &spec->out;
+        out->nimages = split_channels ? channels : 1;
+        out->stride = 3 * spec->params.fftsize * (channels / out->nimages);
+        out->progress = (i == 0);
+    }
+
+    uint32_t npaths;
+    char **paths = expand_inputs(argv + optind, argc - optind, &npaths);
+    char *infile = paths[0];
+
+    int64_t size = reader_total_size(paths, npaths);
+    if (size < 0) {
         return EXIT_FAILURE;
     }
 
-    params.frames = nsamples / (params.fftsize - params.overlap);
+    // With a memory limit, every buffer is sized now, and carved out of one
+    // arena, so that a render that won't fit fails before it starts and one
+    // that does never allocates again. An --append run may start further
+    // in, so size it for the whole input. Unless told otherwise, --landscape
+    // gets its usual budget, or whatever the rest leaves over if that's less.
+    size_t landscape_budget =
+        (landscape_memory ? landscape_memory : DEFAULT_LANDSCAPE_MEMORY) << 20;
+    arena_t *arena = NULL;
+    if (memory_limit > 0) {
+        size_t stride = format_sample_size(params.format) * channels;
+        uint64_t nsamples = ((uint64_t)size > skip && !append)
+                                ? (size - skip) / stride
+                                : size / stride;
+        bool detect_on = strcmp(detect_s, "");
+        bool spectrum_on = strcmp(spectrum_s, "");
+        size_t limit = memory_limit << 20;
+        if (landscape && landscape_memory == 0) {
+            size_t least = render_memory(specs, nspecs, params.format,
+                                         nsamples, block_size, 1, detect_on,
+                                         spectrum_on);
+            // Leave room for rounding each rotator's share up.
+            size_t slack = 0;
+            for (uint32_t i = 0; i < nspecs; i++)
+                slack += specs[i].out.nimages * arena_footprint(1);
+            if (limit < least + slack + landscape_budget)
+                landscape_budget =
+                    (limit > least + slack) ? limit - least - slack : 1;
+        }
+        size_t need = render_memory(specs, nspecs, params.format, nsamples,
+                                    block_size,
+                                    landscape ? landscape_budget : 0,
+                                    detect_on, spectrum_on);
+        if (need > limit) {
+            fprintf(stderr, "This render needs %.1f MB of buffers, more than "
+                            "the memory limit of %" PRIu64 " MB.\n",
+                    need / 1048576.0, memory_limit);
+            return EXIT_FAILURE;
+        }
+        arena = arena_create(need, huge_pages);
+        if (!arena) {
+            return EXIT_FAILURE;
+        }
+        if (verbose)
+            printf("Reserved %.1f MB of buffers%s.\n", need / 1048576.0,
+                   arena_huge_pages(arena) ? " on huge pages" : "");
+    }
 
-    if (!strcmp(outfile, "")) {
-        strcpy(outfile, infile);
-        strcat(outfile, ".png");
+    // Every spec renders on one pool of workers, rather than each starting
+    // its own, so there are only ever --threads of them, each pinned once.
+    pool_t *pool = NULL;
+    placement_t *placement = NULL;
+    uint32_t nworkers = params.threads;
+    if (nworkers > 0) {
+        placement = (placement_t *)malloc(nworkers * sizeof(placement_t));
+        plan_placement(placement, nworkers, params.cpus, params.ncpus,
+                       params.numa);
+        pool = pool_create(nworkers, placement, SPEC_QUEUE_SIZE * nspecs);
+        for (uint32_t i = 0; i < nworkers; i++) {
+            placement[i] = pool_placement(pool, i);
+        }
     }
 
-    if (verbose) {
-        printf("Reading %s samples from %s...\n", fmt_s, infile);
-        printf("Writing %d x %d output to %s...\n", params.fftsize,
-               params.frames, outfile);
+    // The reading thread and this one (which converts samples) feed every
+    // worker, so keep them next to the first one; the others are fed across
+    // the interconnect either way.
+    placement_t io_placement = {-1, -1};
+    if (nworkers > 0) {
+        io_placement.node = placement[0].node;
+        io_placement = place_thread(io_placement);
     }
 
-    FILE *writefp = fopen(outfile, "wb");
-    if (!writefp) {
-        fprintf(stderr, "Error: failed to write to %s.\n", outfile);
-        return EXIT_FAILURE;
+    // With several specs, each one's images are encoded on a thread of its
+    // own (next to this one, which delivers the rows), so that they're
+    // written side by side rather than one after another on this thread.
+    for (uint32_t i = 0; i < nspecs; i++) {
+        render_spec_t *spec = &specs[i];
+        spec->params.arena = arena;
+        spec->params.pool = pool;
+        waterfall_rows_fn rows_fn = write_png_rows;
+        void *userdata = &spec->out;
+        if (nspecs > 1) {
+            placement_t encoder = {io_placement.node, -1};
+            size_t row_size = spec->out.stride * spec->out.nimages;
+            spec->queue = rowqueue_create(row_size, write_png_rows,
+                                          &spec->out, encoder, arena);
+            rows_fn = rowqueue_push;
+            userdata = spec->queue;
+        }
+        spec->wf = waterfall_create(&spec->params, rows_fn, userdata);
+        if (!spec->wf) {
+            fprintf(stderr, "Unknown window function: %s\n", spec->window);
+            return EXIT_FAILURE;
+        }
+        if (verbose)
+            printf("Using a %s window of size %d.\n", spec->window,
+                   spec->params.fftsize);
     }
+    if (verbose && params.bandwidth > 0)
+        printf("Downconverting %f Hz to baseband, decimating by %d.\n", center,
+               ddc_decimation(params.bandwidth));
 
-    png_structp png_ptr =
-        png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr) {
-        fprintf(stderr, "Error: could not initialize write struct.\n");
-        return EXIT_FAILURE;
+    // Without an outfile, a single render goes to <infile>.png, and several
+    // to <infile>.<fftsize>.<window>.png.
+    for (uint32_t i = 0; i < nspecs; i++) {
+        render_spec_t *spec = &specs[i];
+        if (!strcmp(spec->outfile, "")) {
+            if (nspecs == 1)
+                snprintf(spec->outfile, sizeof(spec->outfile), "%s.png",
+                         infile);
+            else
+                snprintf(spec->outfile, sizeof(spec->outfile),
+                         "%s.%d.%s.png", infile, spec->params.fftsize,
+                         spec->window);
+        }
+        for (uint32_t j = 0; j < i; j++) {
+            if (!strcmp(spec->outfile, specs[j].outfile)) {
+                fprintf(stderr, "Two specs write to %s.\n", spec->outfile);
+                return EXIT_FAILURE;
+            }
+        }
     }
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        fprintf(stderr, "Error: could not initialize info struct.\n");
-        png_destroy_write_struct(&png_ptr, NULL);
-        return EXIT_FAILURE;
+    // An incremental render picks up where the state left by the last run
+    // says, and writes the new rows to the next strip.
+    char state_path[PATH_MAX + 16];
+    sidecar_t state;
+    memset(&state, 0, sizeof(state));
+    if (append) {
+        render_spec_t *spec = &specs[0];
+        snprintf(state_path, sizeof(state_path), "%s.state", spec->outfile);
+        int loaded = sidecar_load(&state, state_path);
+        if (loaded < 0) {
+            return EXIT_FAILURE;
+        }
+        if (loaded) {
+            if (strcmp(state.format, fmt_s) ||
+                strcmp(state.window, spec->window) ||
+                state.beta != spec->params.beta || state.channels != channels ||
+                state.fftsize != spec->params.fftsize ||
+                state.overlap != spec->params.overlap ||
+                (state.taps > 1 ? state.taps : 0) !=
+                    (spec->params.taps > 1 ? spec->params.taps : 0)) {
+                fprintf(stderr, "%s was rendered with different settings; "
+                                "remove it to start over.\n",
+                        state_path);
+                return EXIT_FAILURE;
+            }
+            waterfall_resume(spec->wf, state.carry, &state.stats);
+            skip = state.offset;
+        } else {
+            snprintf(state.format, sizeof(state.format), "%s", fmt_s);
+            snprintf(state.window, sizeof(state.window), "%s", spec->window);
+            state.beta = spec->params.beta;
+            state.channels = channels;
+            state.fftsize = spec->params.fftsize;
+            state.overlap = spec->params.overlap;
+            state.taps = spec->params.taps;
+            state.offset = skip;
+            state.carry = (fftw_complex *)calloc(sidecar_carry_len(&state) + 1,
+                                                 sizeof(fftw_complex));
+        }
     }
 
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        fprintf(stderr, "Error: libpng error.\n");
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(writefp);
-        return EXIT_FAILURE;
+    // Only read as far as the input went when we started, so that the images
+    // are the size we said they would be even if a recorder is still writing
+    // to it.
+    size_t stride = format_sample_size(params.format) * channels;
+    uint64_t nsamples = 0;
+    if ((uint64_t)size > skip) {
+        nsamples = (size - skip) / stride;
     }
+    uint64_t left = nsamples * stride;
 
-    png_set_user_limits(png_ptr, 0x7fffffffL, 0x7fffffffL);
+    if (append && waterfall_rows(&specs[0].params, nsamples) == 0) {
+        if (verbose)
+            printf("No new rows to render.\n");
+        return EXIT_SUCCESS;
+    }
 
-    if (verbose)
-        printf("Writing PNG header..\n");
-    png_init_io(png_ptr, writefp);
-    png_set_IHDR(png_ptr, info_ptr, params.fftsize, params.frames, 8,
-                 PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_write_info(png_ptr, info_ptr);
+    if (verbose) {
+        if (npaths > 1)
+            printf("Reading %s samples from %s and %d more...\n", fmt_s,
+                   infile, npaths - 1);
+        else
+            printf("Reading %s samples from %s...\n", fmt_s, infile);
+    }
+
+    for (uint32_t i = 0; i < nspecs; i++) {
+        png_output_t *out = &specs[i].out;
+        out->frames = waterfall_rows(&specs[i].params, nsamples);
+
+        // Landscape images are as wide as the render is long, and the
+        // budget is shared between all of them.
+        uint32_t width = (uint32_t)(out->stride / 3);
+        uint32_t height = out->frames;
+        if (landscape) {
+            height = width;
+            width = out->frames;
+        }
+        size_t budget = landscape_budget / (nspecs * out->nimages);
+        for (uint32_t j = 0; j < out->nimages; j++) {
+            char path[PATH_MAX], base[PATH_MAX];
+            if (append)
+                strip_path(base, sizeof(base), specs[i].outfile,
+                           state.strips);
+            else
+                strcpy(base, specs[i].outfile);
+            if (split_channels)
+                channel_path(path, sizeof(path), base, j);
+            else
+                strcpy(path, base);
+            if (verbose)
+                printf("Writing %d x %d output to %s...\n", width, height,
+                       path);
+            if (png_out_open(&out->images[j], path, width, height, arena) <
+                0) {
+                return EXIT_FAILURE;
+            }
+            if (landscape) {
+                out->rotators[j] =
+                    rotator_create(height, width, budget, arena);
+                if (!out->rotators[j]) {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    events_output_t events;
+    memset(&events, 0, sizeof(events));
+    if (strcmp(detect_s, "")) {
+        size_t len = strlen(detect_s);
+        events.json = (len > 5 && !strcmp(detect_s + len - 5, ".json"));
+        events.fp = fopen(detect_s, "w");
+        if (!events.fp) {
+            fprintf(stderr, "Error: failed to write to %s.\n", detect_s);
+            return EXIT_FAILURE;
+        }
+        if (events.json)
+            fprintf(events.fp, "[");
+        else
+            fprintf(events.fp,
+                    "channel,start_frame,end_frame,low_bin,high_bin,peak_db\n");
+        if (verbose)
+            printf("Writing detections to %s...\n", detect_s);
+        // Overlapping frames share samples, and so noise, and come in faster.
+        // Scale the per frame settings to match frames without overlap.
+        const waterfall_params_t *p = &specs[0].params;
+        uint32_t hop = p->fftsize - p->overlap;
+        detect.min_frames *= p->fftsize / hop;
+        detect.alpha *= (double)hop / p->fftsize;
+        waterfall_set_detector(specs[0].wf, &detect, write_event, &events);
+    }
+
+    spectrum_writer_t *spectrum = NULL;
+    if (strcmp(spectrum_s, "")) {
+        spectrum_info_t info;
+        spectrum_info_init(&info, specs[0].params.fftsize, channels,
+                           specs[0].out.frames);
+        spectrum = spectrum_create(spectrum_s, &info, arena);
+        if (!spectrum) {
+            return EXIT_FAILURE;
+        }
+        if (verbose)
+            printf("Writing spectral cache to %s...\n", spectrum_s);
+        waterfall_set_power_fn(specs[0].wf, spectrum_write_rows, spectrum);
+    }
 
     if (verbose)
         printf("Rendering (this may take a while)...\n");
-    waterfall(png_ptr, readfp, params);
+
+    fanout_t *fanout = NULL;
+    if (nspecs > 1) {
+        fanout = fanout_create(params.format, channels,
+                               arena ? block_size : 0, arena);
+        for (uint32_t i = 0; i < nspecs; i++) {
+            fanout_add(fanout, specs[i].wf);
+        }
+    }
+
+    reader_t *reader = reader_open(paths, npaths, skip, io_placement,
+                                   block_size, arena);
+
+    start_progress();
+    const uint8_t *block;
+    size_t len;
+    while (left > 0 && (len = reader_next(reader, &block)) > 0) {
+        if (len > left)
+            len = left;
+        left -= len;
+        bool more = fanout ? fanout_push(fanout, block, len)
+                           : waterfall_push(specs[0].wf, block, len);
+        if (!more) {
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < nspecs; i++) {
+        waterfall_finish(specs[i].wf);
+        if (specs[i].queue)
+            rowqueue_close(specs[i].queue);
+    }
+    end_progress();
+
+    bool failed = reader_failed(reader);
+    reader_close(reader);
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+
+    if (landscape) {
+        if (verbose)
+            printf("Turning output on its side...\n");
+        for (uint32_t i = 0; i < nspecs; i++) {
+            for (uint32_t j = 0; j < specs[i].out.nimages; j++) {
+                rotator_t *rot = specs[i].out.rotators[j];
+                if (rotator_finish(rot, write_rotated_row,
+                                   &specs[i].out.images[j]) < 0) {
+                    return EXIT_FAILURE;
+                }
+                rotator_destroy(rot);
+            }
+        }
+    }
 
     if (verbose)
         printf("Writing PNG footer...\n");
-    png_write_end(png_ptr, NULL);
+    bool written = true;
+    for (uint32_t i = 0; i < nspecs; i++) {
+        for (uint32_t j = 0; j < specs[i].out.nimages; j++) {
+            if (png_out_close(&specs[i].out.images[j]) < 0)
+                written = false;
+        }
+    }
+    if (!written) {
+        return EXIT_FAILURE;
+    }
+
+    if (spectrum && spectrum_finish(spectrum) < 0) {
+        return EXIT_FAILURE;
+    }
 
-    png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-    png_destroy_write_struct(&png_ptr, NULL);
+    if (events.fp) {
+        if (events.json)
+            fprintf(events.fp, "\n]\n");
+        fclose(events.fp);
+        if (verbose)
+            printf("Detected %" PRIu64 " events.\n", events.count);
+    }
+
+    if (append) {
+        const waterfall_params_t *p = &specs[0].params;
+        uint32_t rows = specs[0].out.frames;
+        state.offset = skip + ((uint64_t)rows * (p->fftsize - p->overlap) *
+                               stride);
+        state.frames += rows;
+        state.strips++;
+        state.stats = *waterfall_stats(specs[0].wf);
+        waterfall_get_carry(specs[0].wf, state.carry);
+        if (sidecar_save(&state, state_path) < 0) {
+            return EXIT_FAILURE;
+        }
+        sidecar_free(&state);
+    }
 
     if (verbose)
         printf("Cleaning up...\n");
-    fclose(writefp);
-    fclose(readfp);
 
-    destroy_window(win);
+    if (verbose) {
+        for (uint32_t i = 0; i < nspecs; i++) {
+            if (nspecs > 1)
+                printf("%s:\n", specs[i].outfile);
+            print_scale_stats(waterfall_stats(specs[i].wf));
+        }
+        for (uint32_t i = 0; i < nworkers; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "Worker %d", i);
+            print_placement(name, placement[i]);
+        }
+        if (nworkers > 0)
+            print_placement("Reader", io_placement);
+        if (arena)
+            printf("Used %.1f MB of %.1f MB reserved.\n",
+                   arena_used(arena) / 1048576.0,
+                   arena_size(arena) / 1048576.0);
+    }
 
-    if (verbose)
-        print_scale_stats();
+    if (fanout)
+        fanout_destroy(fanout);
+    for (uint32_t i = 0; i < nspecs; i++) {
+        waterfall_destroy(specs[i].wf);
+    }
+    if (pool)
+        pool_destroy(pool);
+    free(placement);
+    free(specs);
+    waterfall_cleanup();
+    if (arena)
+        arena_destroy(arena);
+
+    for (uint32_t i = 0; i < npaths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "arena.h"
+#include "rotate.h"
+
+// Pixels per side of the tiles transposed at a time: a tile of the input and
+// one of the output (32 x 32 x 3 bytes each) fit in L1 together.
+#define TILE 32
+
+struct rotator {
+    uint32_t width;
+    uint32_t height;
+    size_t budget;
+
+    // Rows per block, the block being filled, and its transpose.
+    uint32_t block_rows;
+    uint8_t *in;
+    uint8_t *out;
+    uint32_t fill;
+    uint32_t rows;
+
+    // Transposed blocks, one after another, each stored as width rows of
+    // block_rows pixels. They are kept in mem if the whole image fits in
+    // half the budget, or else in the temporary file fd.
+    uint8_t *mem;
+    int fd;
+    uint64_t stored;
+
+    // With an arena, one region of it that mem, the blocks, and then the
+    // output band are all laid out in, instead of allocating each.
+    uint8_t *region;
+    size_t region_len;
+
+    bool failed;
+};
+
+// Rows per block, with what's left of the budget once an image of total bytes
+// is kept in memory (or not).
+static uint32_t block_rows(uint32_t width, uint32_t height, size_t budget,
+                           uint64_t total, bool in_mem) {
+    if (in_mem)
+        budget -= total;
+    uint64_t rows = budget / ((uint64_t)width * 3 * 2);
+    if (rows < 1)
+        rows = 1;
+    if (rows > height)
+        rows = height;
+    return (uint32_t)rows;
+}
+
+// The budget, or more if the smallest blocks or band don't fit in it.
+static size_t region_len(uint32_t width, uint32_t height, size_t budget) {
+    uint64_t total = (uint64_t)width * height * 3;
+    bool in_mem = (total <= budget / 2);
+    uint64_t rows = block_rows(width, height, budget, total, in_mem);
+    uint64_t kept = in_mem ? total : 0;
+    uint64_t len = budget;
+    if (kept + (rows * width * 3 * 2) > len)
+        len = kept + (rows * width * 3 * 2);
+    if (kept + (((uint64_t)height + rows) * 3) > len)
+        len = kept + (((uint64_t)height + rows) * 3);
+    return (size_t)len;
+}
+
+size_t rotator_memory(uint32_t width, uint32_t height, size_t budget) {
+    return arena_footprint(region_len(width, height, budget));
+}
+
+rotator_t *rotator_create(uint32_t width, uint32_t height, size_t budget,
+                          arena_t *arena) {
+    rotator_t *r = (rotator_t *)calloc(1, sizeof(rotator_t));
+    r->width = width;
+    r->height = height;
+    r->budget = budget;
+    r->fd = -1;
+    if (arena) {
+        r->region_len = region_len(width, height, budget);
+        r->region = (uint8_t *)arena_alloc(arena, r->region_len);
+    }
+
+    uint64_t total = (uint64_t)width * height * 3;
+    bool in_mem = (total <= budget / 2);
+    if (in_mem) {
+        r->mem = r->region ? r->region : (uint8_t *)malloc(total ? total : 1);
+    } else {
+        const char *dir = getenv("TMPDIR");
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/renderfall-XXXXXX",
+                 dir ? dir : "/tmp");
+        r->fd = mkstemp(path);
+        if (r->fd < 0) {
+            fprintf(stderr, "Error: failed to create a temporary file in %s.\n",
+                    dir ? dir : "/tmp");
+            free(r);
+            return NULL;
+        }
+        // Nothing else needs the name, and this way it can't be left behind.
+        unlink(path);
+    }
+
+    // A block and its transpose share what's left of the budget.
+    r->block_rows = block_rows(width, height, budget, total, in_mem);
+    size_t block = (size_t)r->block_rows * width * 3;
+    if (r->region) {
+        r->in = r->region + (in_mem ? total : 0);
+        r->out = r->in + block;
+    } else {
+        r->in = (uint8_t *)malloc(block);
+        r->out = (uint8_t *)malloc(block);
+    }
+    return r;
+}
+
+void rotator_destroy(rotator_t *r) {
+    if (r->fd >= 0)
+        close(r->fd);
+    if (!r->region) {
+        free(r->mem);
+        free(r->in);
+        free(r->out);
+    }
+    free(r);
+}
+
+// Transpose rows x width pixels from in to width x rows pixels in out, with
+// the last input column becoming the first output row.
+static void transpose_block(const uint8_t *in, uint8_t *out, uint32_t rows,
+                            uint32_t width) {
+    size_t in_stride = (size_t)width * 3;
+    for (uint32_t y0 = 0; y0 < rows; y0 += TILE) {
+        uint32_t y1 = (y0 + TILE < rows) ? y0 + TILE : rows;
+        for (uint32_t x0 = 0; x0 < width; x0 += TILE) {
+            uint32_t x1 = (x0 + TILE < width) ? x0 + TILE : width;
+            for (uint32_t x = x0; x < x1; x++) {
+                const uint8_t *src = in + (y0 * in_stride) + (x * 3);
+                uint8_t *dst = out + ((((size_t)(width - 1 - x) * rows) + y0) * 3);
+                for (uint32_t y = y0; y < y1; y++) {
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                    src += in_stride;
+                    dst += 3;
+                }
+            }
+        }
+    }
+}
+
+static void store(rotator_t *r, const uint8_t *buf, size_t len) {
+    if (r->mem) {
+        memcpy(r->mem + r->stored, buf, len);
+        r->stored += len;
+        return;
+    }
+    while (len > 0 && !r->failed) {
+        ssize_t n = pwrite(r->fd, buf, len, (off_t)r->stored);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error: failed to write to the temporary file.\n");
+            r->failed = true;
+            return;
+        }
+        buf += n;
+        len -= n;
+        r->stored += n;
+    }
+}
+
+static bool load(rotator_t *r, uint8_t *buf, size_t len, uint64_t offset) {
+    if (r->mem) {
+        memcpy(buf, r->mem + offset, len);
+        return true;
+    }
+    while (len > 0) {
+        ssize_t n = pread(r->fd, buf, len, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr,
+                    "Error: failed to read back the temporary file.\n");
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static void flush_block(rotator_t *r) {
+    transpose_block(r->in, r->out, r->fill, r->width);
+    store(r, r->out, (size_t)r->fill * r->width * 3);
+    r->fill = 0;
+}
+
+void rotator_write_row(rotator_t *r, const uint8_t *row) {
+    if (r->rows == r->height)
+        return;
+    memcpy(r->in + ((size_t)r->fill * r->width * 3), row,
+           (size_t)r->width * 3);
+    r->rows++;
+    if (++r->fill == r->block_rows)
+        flush_block(r);
+}
+
+int rotator_finish(rotator_t *r, rotator_row_fn fn, void *userdata) {
+    if (r->fill > 0)
+        flush_block(r);
+    if (r->failed)
+        return -1;
+
+    // The blocks are no longer needed; reuse the budget for a band of output
+    // rows, along with room to read one block's part of the band.
+    uint64_t budget = r->mem ? r->budget - r->stored : r->budget;
+    uint8_t *region = NULL;
+    if (r->region) {
+        region = r->in;
+        budget = r->region_len - (region - r->region);
+    } else {
+        free(r->in);
+        free(r->out);
+    }
+    r->in = r->out = NULL;
+
+    uint64_t band = budget / (((uint64_t)r->height + r->block_rows) * 3);
+    if (band < 1)
+        band = 1;
+    if (band > r->width)
+        band = r->width;
+
+    size_t out_stride = (size_t)r->height * 3;
+    uint8_t *rows, *scratch;
+    if (r->region) {
+        rows = region;
+        scratch = rows + (band * out_stride);
+    } else {
+        rows = (uint8_t *)malloc(band * out_stride);
+        scratch = (uint8_t *)malloc(band * r->block_rows * 3);
+    }
+    uint32_t nblocks = (r->rows + r->block_rows - 1) / r->block_rows;
+    int ret = 0;
+
+    for (uint32_t y0 = 0; y0 < r->width && ret == 0; y0 += band) {
+        uint32_t n = (y0 + band < r->width) ? band : r->width - y0;
+        memset(rows, 0, n * out_stride);
+
+        // Each block holds every output row for its stretch of columns, so
+        // this band's rows are one contiguous read per block.
+        for (uint32_t b = 0; b < nblocks; b++) {
+            uint64_t first = (uint64_t)b * r->block_rows;
+            uint32_t cols = (first + r->block_rows <= r->rows)
+                                ? r->block_rows
+                                : (uint32_t)(r->rows - first);
+            size_t len = (size_t)cols * 3;
+            uint64_t offset = (first * r->width * 3) + ((uint64_t)y0 * len);
+            if (!load(r, scratch, n * len, offset)) {
+                ret = -1;
+                break;
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                memcpy(rows + (i * out_stride) + (first * 3),
+                       scratch + (i * len), len);
+            }
+        }
+        for (uint32_t i = 0; i < n && ret == 0; i++) {
+            fn(userdata, rows + (i * out_stride));
+        }
+    }
+
+    if (!r->region) {
+        free(rows);
+        free(scratch);
+    }
+    return ret;
+}
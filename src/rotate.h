@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// Turns an RGB image written to it row by row a quarter turn
+// counterclockwise, so that the first row becomes the leftmost column, read
+// bottom to top. Rows are buffered a block at a time, transposed in cache
+// sized tiles, and spilled to a temporary file once the image no longer fits
+// in the memory budget, so memory use stays bounded however big the image
+// is.
+typedef struct rotator rotator_t;
+
+typedef void (*rotator_row_fn)(void *userdata, const uint8_t *row);
+
+// width and height are those of the image going in. With an arena, the
+// budget is taken out of it in one piece (see rotator_memory()). Returns NULL
+// (after reporting why on stderr) if no temporary file could be created.
+rotator_t *rotator_create(uint32_t width, uint32_t height, size_t budget,
+                          arena_t *arena);
+
+// Bytes a rotator takes out of its arena: the budget, or a little more if
+// it's too small for even a single row at a time.
+size_t rotator_memory(uint32_t width, uint32_t height, size_t budget);
+
+// Add the next row, width RGB pixels.
+void rotator_write_row(rotator_t *r, const uint8_t *row);
+
+// Pass the rotated image to fn, one row (height RGB pixels) at a time.
+// Columns for rows that were never written are left black. Returns -1 (after
+// reporting why on stderr) if the temporary file couldn't be written or read.
+int rotator_finish(rotator_t *r, rotator_row_fn fn, void *userdata);
+
+void rotator_destroy(rotator_t *r);
@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "arena.h"
+#include "rowqueue.h"
+
+// Batches queued ahead of the consumer.
+#define QUEUE_BATCHES 4
+
+// Rows are copied in batches of about this many bytes (or a single row, if
+// one is bigger).
+#define BATCH_BYTES (1 << 20)
+
+typedef struct {
+    uint8_t *rows;
+    uint32_t y;
+    uint32_t nrows;
+} batch_t;
+
+struct rowqueue {
+    size_t row_size;
+    uint32_t batch_rows;
+    waterfall_rows_fn fn;
+    void *userdata;
+    placement_t placement;
+    arena_t *arena;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Ring of batches: filled by the producer, emptied in order by the
+    // queue's thread. The batch at head stays queued until the callback is
+    // done with it.
+    batch_t batches[QUEUE_BATCHES];
+    uint32_t head;
+    uint32_t count;
+    bool stop;
+};
+
+static uint32_t batch_rows(size_t row_size) {
+    size_t rows = BATCH_BYTES / row_size;
+    return rows > 0 ? (uint32_t)rows : 1;
+}
+
+size_t rowqueue_memory(size_t row_size) {
+    return QUEUE_BATCHES * arena_footprint(batch_rows(row_size) * row_size);
+}
+
+static void *rowqueue_main(void *arg) {
+    rowqueue_t *q = (rowqueue_t *)arg;
+
+    q->placement = place_thread(q->placement);
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->count == 0 && !q->stop) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if (q->count == 0) {
+            break;
+        }
+        batch_t *b = &q->batches[q->head];
+        pthread_mutex_unlock(&q->lock);
+
+        q->fn(q->userdata, b->y, b->nrows, b->rows);
+
+        pthread_mutex_lock(&q->lock);
+        q->head = (q->head + 1) % QUEUE_BATCHES;
+        q->count--;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+rowqueue_t *rowqueue_create(size_t row_size, waterfall_rows_fn fn,
+                            void *userdata, placement_t placement,
+                            arena_t *arena) {
+    rowqueue_t *q = (rowqueue_t *)calloc(1, sizeof(rowqueue_t));
+    q->row_size = row_size;
+    q->batch_rows = batch_rows(row_size);
+    q->fn = fn;
+    q->userdata = userdata;
+    q->placement = placement;
+    q->arena = arena;
+    size_t size = q->batch_rows * row_size;
+    for (uint32_t i = 0; i < QUEUE_BATCHES; i++) {
+        q->batches[i].rows = arena ? (uint8_t *)arena_alloc(arena, size) : NULL;
+        if (!q->batches[i].rows)
+            q->batches[i].rows = (uint8_t *)malloc(size);
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    pthread_create(&q->thread, NULL, rowqueue_main, q);
+    return q;
+}
+
+void rowqueue_push(void *userdata, uint32_t y, uint32_t nrows,
+                   const uint8_t *rows) {
+    rowqueue_t *q = (rowqueue_t *)userdata;
+    while (nrows > 0) {
+        uint32_t n = (nrows < q->batch_rows) ? nrows : q->batch_rows;
+
+        // Wait for a free batch. Only this thread adds to the ring, so it
+        // stays free once the lock is dropped.
+        pthread_mutex_lock(&q->lock);
+        while (q->count == QUEUE_BATCHES) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        batch_t *b = &q->batches[(q->head + q->count) % QUEUE_BATCHES];
+        pthread_mutex_unlock(&q->lock);
+
+        memcpy(b->rows, rows, n * q->row_size);
+        b->y = y;
+        b->nrows = n;
+
+        pthread_mutex_lock(&q->lock);
+        q->count++;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        y += n;
+        nrows -= n;
+        rows += n * q->row_size;
+    }
+}
+
+void rowqueue_close(rowqueue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+
+    for (uint32_t i = 0; i < QUEUE_BATCHES; i++) {
+        if (!q->arena || !arena_owns(q->arena, q->batches[i].rows))
+            free(q->batches[i].rows);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+    free(q);
+}
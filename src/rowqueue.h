@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "affinity.h"
+#include "arena.h"
+#include "waterfall.h"
+
+// Hands rows to a callback on a thread of its own, a few batches behind the
+// render producing them, so that a slow consumer (such as a PNG encoder)
+// runs alongside the render rather than holding up the thread feeding it.
+// Rows are copied in, and handed over in order.
+typedef struct rowqueue rowqueue_t;
+
+// Pass rows of row_size bytes to fn (on the queue's thread, which is moved to
+// placement). With an arena, the batches come out of it.
+rowqueue_t *rowqueue_create(size_t row_size, waterfall_rows_fn fn,
+                            void *userdata, placement_t placement,
+                            arena_t *arena);
+
+// Bytes a queue for rows of row_size bytes takes out of its arena.
+size_t rowqueue_memory(size_t row_size);
+
+// Queue nrows rows, starting at row y, for the callback. A waterfall_rows_fn,
+// with the queue as its userdata. Blocks while the queue is full.
+void rowqueue_push(void *userdata, uint32_t y, uint32_t nrows,
+                   const uint8_t *rows);
+
+// Hand over any rows still queued, then stop the thread.
+void rowqueue_close(rowqueue_t *q);
@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <netinet/in.h>
+
+#include "affinity.h"
+#include "colormap.h"
+#include "pngout.h"
+#include "pool.h"
+#include "serve.h"
+#include "spectrum.h"
+#include "tilecache.h"
+
+#define DEFAULT_PORT 8080
+#define DEFAULT_THREADS 4
+// Default --cache, in MB.
+#define DEFAULT_CACHE 256
+
+// Connections queued per worker before accepting blocks.
+#define CONNS_PER_WORKER 16
+
+// Longest request (line and headers) read.
+#define MAX_REQUEST 8192
+
+// Clients that send nothing for this long are dropped, so they don't hold a
+// worker.
+#define REQUEST_TIMEOUT 5
+
+// The range black on white images are rendered with, so gray tiles match them
+// by default: scale_log() steps 85 levels per decade of magnitude, 4.25 per dB
+// of power, and puts 0 dB at level 200.
+#define DEFAULT_MIN_DB (-200.0 / 4.25)
+#define DEFAULT_MAX_DB (56.0 / 4.25)
+
+typedef struct {
+    spectrum_t spectrum;
+    tile_cache_t *cache;
+    // Each worker colors its tiles into its own buffer.
+    uint8_t **rgb;
+    bool verbose;
+} server_t;
+
+typedef struct {
+    server_t *server;
+    int fd;
+} conn_t;
+
+// Scrolls around the tiles of one level at a time. Everything else is done
+// by the server.
+static const char viewer_html[] =
+    "<!DOCTYPE html>\n"
+    "<html><head><meta charset=\"utf-8\"><title>renderfall</title><style>\n"
+    "body{margin:0;font:13px sans-serif}#bar{padding:4px}\n"
+    "#view{position:absolute;top:2.2em;bottom:0;left:0;right:0;"
+    "overflow:auto}\n"
+    "#tiles{position:relative}#tiles img{position:absolute}\n"
+    "</style></head><body><div id=\"bar\">\n"
+    "level <select id=\"level\"></select>\n"
+    "colormap <select id=\"cmap\"><option>gray<option>hue</select>\n"
+    "min <input id=\"lo\" size=\"5\" value=\"-47.06\"> dB\n"
+    "max <input id=\"hi\" size=\"5\" value=\"13.18\"> dB\n"
+    "<span id=\"desc\"></span></div>\n"
+    "<div id=\"view\"><div id=\"tiles\"></div></div><script>\n"
+    "var T = 256, info, shown = {};\n"
+    "function query() {\n"
+    "  return '?colormap=' + cmap.value + '&min=' + lo.value + '&max=' + "
+    "hi.value;\n"
+    "}\n"
+    "function draw() {\n"
+    "  var l = +level.value, s = Math.pow(2, l);\n"
+    "  var w = Math.ceil(info.width / s), h = Math.ceil(info.frames / s);\n"
+    "  tiles.style.width = w + 'px';\n"
+    "  tiles.style.height = h + 'px';\n"
+    "  var x1 = Math.min(Math.ceil(w / T), "
+    "Math.ceil((view.scrollLeft + view.clientWidth) / T));\n"
+    "  var y1 = Math.min(Math.ceil(h / T), "
+    "Math.ceil((view.scrollTop + view.clientHeight) / T));\n"
+    "  for (var y = Math.floor(view.scrollTop / T); y < y1; y++) {\n"
+    "    for (var x = Math.floor(view.scrollLeft / T); x < x1; x++) {\n"
+    "      var src = '/tiles/' + l + '/' + x + '/' + y + '.png' + query();\n"
+    "      if (shown[src]) continue;\n"
+    "      var img = new Image();\n"
+    "      img.src = src;\n"
+    "      img.style.left = x * T + 'px';\n"
+    "      img.style.top = y * T + 'px';\n"
+    "      tiles.appendChild(img);\n"
+    "      shown[src] = true;\n"
+    "    }\n"
+    "  }\n"
+    "}\n"
+    "function reset() {\n"
+    "  tiles.innerHTML = '';\n"
+    "  shown = {};\n"
+    "  draw();\n"
+    "}\n"
+    "fetch('/info').then(function (r) { return r.json(); })"
+    ".then(function (j) {\n"
+    "  info = j;\n"
+    "  for (var l = j.levels - 1; l >= 0; l--) level.add(new Option(l));\n"
+    "  level.value = j.levels - 1;\n"
+    "  desc.textContent = j.frames + ' frames of ' + j.fftsize + ' bins x ' "
+    "+ j.channels + ' channels';\n"
+    "  reset();\n"
+    "});\n"
+    "view.onscroll = window.onresize = draw;\n"
+    "level.onchange = cmap.onchange = lo.onchange = hi.onchange = reset;\n"
+    "</script></body></html>\n";
+
+// Listening socket, shut down by SIGINT or SIGTERM to stop the accept loop.
+static int listen_fd = -1;
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_serving(int sig) {
+    (void)sig;
+    stopping = 1;
+    shutdown(listen_fd, SHUT_RDWR);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void send_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void respond(int fd, int status, const char *type, const void *body,
+                    size_t len) {
+    const char *reason = (status == 200)   ? "OK"
+                         : (status == 400) ? "Bad Request"
+                         : (status == 404) ? "Not Found"
+                         : (status == 405) ? "Method Not Allowed"
+                                           : "Internal Server Error";
+    char hdr[256];
+    int n = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Connection: close\r\n\r\n",
+                     status, reason, type, len);
+    send_all(fd, hdr, n);
+    send_all(fd, body, len);
+}
+
+static int respond_error(int fd, int status, const char *msg) {
+    respond(fd, status, "text/plain", msg, strlen(msg));
+    return status;
+}
+
+// Value of a query parameter, copied into val. Returns false if it's absent.
+static bool query_param(const char *query, const char *name, char *val,
+                        size_t size) {
+    size_t len = strlen(name);
+    for (const char *p = query; p && *p; p = strchr(p, '&')) {
+        if (*p == '&')
+            p++;
+        if (!strncmp(p, name, len) && p[len] == '=') {
+            p += len + 1;
+            size_t n = strcspn(p, "&");
+            if (n >= size)
+                n = size - 1;
+            memcpy(val, p, n);
+            val[n] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// Color a tile into rgb, which holds SPECTRUM_TILE x SPECTRUM_TILE pixels,
+// and encode it. Returns -1 if it couldn't be encoded.
+static int render_tile(const spectrum_t *s, uint32_t level, uint32_t tx,
+                       uint32_t ty, colormap_t cm, double min, double max,
+                       uint8_t *rgb, uint8_t **data, size_t *len) {
+    uint32_t x0 = tx * SPECTRUM_TILE;
+    uint64_t y0 = (uint64_t)ty * SPECTRUM_TILE;
+    uint32_t w = spectrum_level_width(&s->info, level) - x0;
+    uint64_t h = spectrum_level_rows(&s->info, level) - y0;
+    if (w > SPECTRUM_TILE)
+        w = SPECTRUM_TILE;
+    if (h > SPECTRUM_TILE)
+        h = SPECTRUM_TILE;
+
+    uint8_t lut[256][3];
+    colormap_lut(cm, lut);
+    float lo = (float)min;
+    float scale = (float)(256.0 / (max - min));
+
+    for (uint32_t y = 0; y < h; y++) {
+        const float *row = spectrum_row(s, level, y0 + y) + x0;
+        uint8_t *px = rgb + (y * w * 3);
+        for (uint32_t x = 0; x < w; x++) {
+            float i = (row[x] - lo) * scale;
+            int idx = (i >= 255) ? 255 : (i > 0) ? (int)i : 0;
+            px[x * 3] = lut[idx][0];
+            px[x * 3 + 1] = lut[idx][1];
+            px[x * 3 + 2] = lut[idx][2];
+        }
+    }
+    return png_encode(rgb, w, (uint32_t)h, data, len);
+}
+
+// Serve /tiles/<level>/<x>/<y>.png, with x counting tiles across the
+// spectrum and y down through time. Level 0 is full resolution, and each
+// level after halves both.
+static int serve_tile(server_t *server, uint32_t worker, int fd,
+                      const char *path, const char *query) {
+    const spectrum_t *s = &server->spectrum;
+    uint32_t level, tx, ty;
+    int end = 0;
+    if (sscanf(path, "/tiles/%" SCNu32 "/%" SCNu32 "/%" SCNu32 ".png%n",
+               &level, &tx, &ty, &end) != 3 ||
+        path[end] != '\0') {
+        return respond_error(fd, 404, "Not found\n");
+    }
+    if (level >= s->info.levels ||
+        (uint64_t)tx * SPECTRUM_TILE >= spectrum_level_width(&s->info, level) ||
+        (uint64_t)ty * SPECTRUM_TILE >= spectrum_level_rows(&s->info, level)) {
+        return respond_error(fd, 404, "No such tile\n");
+    }
+
+    char val[64];
+    colormap_t cm = COLORMAP_GRAY;
+    double min = DEFAULT_MIN_DB;
+    double max = DEFAULT_MAX_DB;
+    if (query_param(query, "colormap", val, sizeof(val)) &&
+        parse_colormap(&cm, val) < 0) {
+        return respond_error(fd, 400, "Unknown colormap\n");
+    }
+    char *e;
+    if (query_param(query, "min", val, sizeof(val)) &&
+        ((min = strtod(val, &e)), *e || !isfinite(min))) {
+        return respond_error(fd, 400, "Invalid min\n");
+    }
+    if (query_param(query, "max", val, sizeof(val)) &&
+        ((max = strtod(val, &e)), *e || !isfinite(max))) {
+        return respond_error(fd, 400, "Invalid max\n");
+    }
+    if (max <= min || !isfinite(max - min)) {
+        return respond_error(fd, 400, "max must be above min\n");
+    }
+
+    char key[TILE_KEY_SIZE];
+    snprintf(key, sizeof(key),
+             "%" PRIu32 "/%" PRIu32 "/%" PRIu32 "/%d/%a/%a", level, tx, ty,
+             (int)cm, min, max);
+    tile_t *tile = tile_cache_get(server->cache, key);
+    if (!tile) {
+        uint8_t *data;
+        size_t len;
+        if (render_tile(s, level, tx, ty, cm, min, max, server->rgb[worker],
+                        &data, &len) < 0) {
+            return respond_error(fd, 500, "Failed to encode tile\n");
+        }
+        tile = tile_cache_put(server->cache, key, data, len);
+    }
+    respond(fd, 200, "image/png", tile->data, tile->len);
+    tile_release(server->cache, tile);
+    return 200;
+}
+
+static int serve_info(server_t *server, int fd) {
+    const spectrum_info_t *info = &server->spectrum.info;
+    char body[256];
+    int n = snprintf(body, sizeof(body),
+                     "{\"width\": %d, \"frames\": %" PRIu64
+                     ", \"fftsize\": %d, \"channels\": %d, \"levels\": %d, "
+                     "\"tile\": %d}\n",
+                     info->width, info->frames, info->fftsize, info->channels,
+                     info->levels, SPECTRUM_TILE);
+    respond(fd, 200, "application/json", body, n);
+    return 200;
+}
+
+// Read a request up to the end of its headers. Returns its length, or -1.
+static int read_request(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t n = recv(fd, buf + len, size - 1 - len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            return (int)len;
+        }
+    }
+    return -1;
+}
+
+static void handle_conn(void *arg, uint32_t worker) {
+    conn_t *conn = (conn_t *)arg;
+    server_t *server = conn->server;
+    int fd = conn->fd;
+    free(conn);
+
+    char req[MAX_REQUEST];
+    if (read_request(fd, req, sizeof(req)) < 0) {
+        close(fd);
+        return;
+    }
+
+    double start = now_ms();
+    char method[16], target[1024];
+    int status;
+    if (sscanf(req, "%15s %1023s", method, target) != 2) {
+        status = respond_error(fd, 400, "Bad request\n");
+    } else if (strcmp(method, "GET")) {
+        status = respond_error(fd, 405, "Only GET is supported\n");
+    } else {
+        char *query = strchr(target, '?');
+        if (query)
+            *query++ = '\0';
+        if (!strcmp(target, "/")) {
+            respond(fd, 200, "text/html", viewer_html,
+                    sizeof(viewer_html) - 1);
+            status = 200;
+        } else if (!strcmp(target, "/info")) {
+            status = serve_info(server, fd);
+        } else {
+            status = serve_tile(server, worker, fd, target, query);
+        }
+        if (query)
+            query[-1] = '?';
+    }
+    if (server->verbose) {
+        printf("%s %s %d %.2f ms\n", method, target, status, now_ms() - start);
+        fflush(stdout);
+    }
+    close(fd);
+}
+
+static void serve_usage(char *arg) {
+    fprintf(stderr, "Usage: %s serve [OPTIONS] <spectrum>\n", arg);
+    fprintf(stderr, "Serve tiles of a spectral cache written with "
+                    "--spectrum over HTTP.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -p, --port <port>\tPort to listen on (defaults to "
+                    "8080)\n");
+    fprintf(stderr, "      --bind <addr>\tAddress to listen on (defaults to "
+                    "127.0.0.1)\n");
+    fprintf(stderr, "  -t, --threads <n>\tRender tiles on N worker threads "
+                    "(defaults to 4)\n");
+    fprintf(stderr, "      --cache <MB>\tMemory for encoded tiles (defaults "
+                    "to 256)\n");
+    fprintf(stderr, "  -v, --verbose \t\tLog every request\n");
+}
+
+int serve_main(int argc, char *argv[]) {
+    int verbose = 0;
+    uint32_t port = DEFAULT_PORT;
+    uint32_t threads = DEFAULT_THREADS;
+    uint64_t cache_mb = DEFAULT_CACHE;
+    const char *bind_addr = "127.0.0.1";
+
+    struct option long_options[] = {{"verbose", no_argument, &verbose, 1},
+                                    {"help", no_argument, NULL, 'h'},
+                                    {"port", required_argument, NULL, 'p'},
+                                    {"bind", required_argument, NULL, 'A'},
+                                    {"threads", required_argument, NULL, 't'},
+                                    {"cache", required_argument, NULL, 'K'},
+                                    {0, 0, 0, 0}};
+
+    int c, option_index;
+    char *end;
+    while ((c = getopt_long(argc, argv, "hvp:t:", long_options,
+                            &option_index)) != -1) {
+        switch (c) {
+        case 0:
+            break;
+        case 'h':
+            serve_usage(argv[0]);
+            return EXIT_SUCCESS;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'p':
+            port = (uint32_t)strtoul(optarg, &end, 0);
+            if (*end || port == 0 || port > 65535) {
+                fprintf(stderr, "Invalid port: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            bind_addr = optarg;
+            break;
+        case 't':
+            threads = (uint32_t)strtoul(optarg, &end, 0);
+            if (*end || threads == 0) {
+                fprintf(stderr, "Invalid value for threads\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'K':
+            cache_mb = strtoull(optarg, &end, 0);
+            if (*end) {
+                fprintf(stderr, "Invalid value for cache\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            serve_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((argc - optind) != 1) {
+        fprintf(stderr, "Must supply a spectral cache.\n");
+        serve_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    server.verbose = verbose;
+    if (spectrum_open(&server.spectrum, argv[optind]) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", bind_addr);
+        return EXIT_FAILURE;
+    }
+    int one = 1;
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 ||
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 128) < 0) {
+        fprintf(stderr, "Error: can't listen on %s:%d: %s\n", bind_addr, port,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    server.cache = tile_cache_create(cache_mb << 20);
+    server.rgb = (uint8_t **)malloc(threads * sizeof(uint8_t *));
+    for (uint32_t i = 0; i < threads; i++) {
+        server.rgb[i] = (uint8_t *)malloc(SPECTRUM_TILE * SPECTRUM_TILE * 3);
+    }
+
+    // Only this thread takes SIGINT and SIGTERM, which stop it accepting
+    // connections; the workers finish the ones they have, and we exit.
+    sigset_t signals, old;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+    placement_t *placement =
+        (placement_t *)malloc(threads * sizeof(placement_t));
+    plan_placement(placement, threads, NULL, 0, false);
+    pool_t *pool = pool_create(threads, placement, CONNS_PER_WORKER);
+
+    listen_fd = lfd;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_serving;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    const spectrum_info_t *info = &server.spectrum.info;
+    printf("Serving %" PRIu64 " frames of %d bins (%d levels) on "
+           "http://%s:%d/\n",
+           info->frames, info->width, info->levels, bind_addr, port);
+    fflush(stdout);
+
+    // Connections are handed to the workers round robin.
+    struct timeval timeout = {REQUEST_TIMEOUT, 0};
+    uint32_t next = 0;
+    int ret = EXIT_SUCCESS;
+    while (!stopping) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (stopping)
+                break;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            ret = EXIT_FAILURE;
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        conn_t *conn = (conn_t *)malloc(sizeof(conn_t));
+        conn->server = &server;
+        conn->fd = fd;
+        pool_submit(pool, next, handle_conn, conn);
+        next = (next + 1) % threads;
+    }
+
+    if (stopping && verbose)
+        printf("Shutting down.\n");
+    pool_destroy(pool);
+    free(placement);
+    for (uint32_t i = 0; i < threads; i++) {
+        free(server.rgb[i]);
+    }
+    free(server.rgb);
+    tile_cache_destroy(server.cache);
+    spectrum_close(&server.spectrum);
+    close(lfd);
+    return ret;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+// Entry point for "renderfall serve": serve tiles of a spectral cache (see
+// spectrum.h) over HTTP. Takes the arguments following "serve", with the
+// program name in argv[0].
+int serve_main(int argc, char *argv[]);
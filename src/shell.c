@@ -7,7 +7,7 @@ void start_progress(void) {
 }
 
 void update_progress(uint32_t pos, uint32_t total) {
-    if (pos % (total / 100) == 0) {
+    if ((total < 100) || (pos % (total / 100) == 0)) {
         printf("\rProgress: %d%%", ((100 * pos) / total));
         fflush(stdout);
     }
@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fftw3.h>
+
+#include "sidecar.h"
+
+#define SIDECAR_MAGIC "renderfall-state"
+#define SIDECAR_VERSION 1
+
+uint32_t sidecar_carry_len(const sidecar_t *s) {
+    uint32_t branches = (s->taps > 1) ? s->taps - 1 : 0;
+    return (branches * s->fftsize + s->overlap) * s->channels;
+}
+
+static int read_carry(sidecar_t *s, FILE *fp) {
+    uint32_t n = sidecar_carry_len(s);
+    s->carry = (fftw_complex *)calloc(n ? n : 1, sizeof(fftw_complex));
+    for (uint32_t i = 0; i < n; i++) {
+        char re[64], im[64];
+        if (fscanf(fp, "%63s %63s", re, im) != 2) {
+            return -1;
+        }
+        s->carry[i][0] = strtod(re, NULL);
+        s->carry[i][1] = strtod(im, NULL);
+    }
+    return 0;
+}
+
+int sidecar_load(sidecar_t *s, const char *path) {
+    memset(s, 0, sizeof(sidecar_t));
+    colormap_stats_init(&s->stats);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Error: failed to read %s.\n", path);
+        return -1;
+    }
+
+    char key[64], val[255];
+    int version = 0;
+    int ok = (fscanf(fp, "%63s %d", key, &version) == 2) &&
+             !strcmp(key, SIDECAR_MAGIC) && (version == SIDECAR_VERSION);
+
+    // The carry comes last, after its length.
+    while (ok && fscanf(fp, "%63s %254s", key, val) == 2) {
+        if (!strcmp(key, "format")) {
+            snprintf(s->format, sizeof(s->format), "%s", val);
+        } else if (!strcmp(key, "window")) {
+            snprintf(s->window, sizeof(s->window), "%s", val);
+        } else if (!strcmp(key, "beta")) {
+            s->beta = strtod(val, NULL);
+        } else if (!strcmp(key, "channels")) {
+            s->channels = (uint32_t)strtoul(val, NULL, 10);
+        } else if (!strcmp(key, "fftsize")) {
+            s->fftsize = (uint32_t)strtoul(val, NULL, 10);
+        } else if (!strcmp(key, "overlap")) {
+            s->overlap = (uint32_t)strtoul(val, NULL, 10);
+        } else if (!strcmp(key, "taps")) {
+            s->taps = (uint32_t)strtoul(val, NULL, 10);
+        } else if (!strcmp(key, "offset")) {
+            s->offset = strtoull(val, NULL, 10);
+        } else if (!strcmp(key, "frames")) {
+            s->frames = strtoull(val, NULL, 10);
+        } else if (!strcmp(key, "strips")) {
+            s->strips = (uint32_t)strtoul(val, NULL, 10);
+        } else if (!strcmp(key, "maxdb")) {
+            s->stats.maxdb = strtod(val, NULL);
+        } else if (!strcmp(key, "mindb")) {
+            s->stats.mindb = strtod(val, NULL);
+        } else if (!strcmp(key, "maxval")) {
+            s->stats.maxval = (int32_t)strtol(val, NULL, 10);
+        } else if (!strcmp(key, "minval")) {
+            s->stats.minval = (int32_t)strtol(val, NULL, 10);
+        } else if (!strcmp(key, "carry")) {
+            ok = (strtoul(val, NULL, 10) == sidecar_carry_len(s)) &&
+                 (read_carry(s, fp) == 0);
+            break;
+        } else {
+            ok = 0;
+        }
+    }
+    fclose(fp);
+
+    if (!ok || !s->carry || s->fftsize == 0) {
+        fprintf(stderr, "Error: %s is not a valid state file.\n", path);
+        sidecar_free(s);
+        return -1;
+    }
+    return 1;
+}
+
+int sidecar_save(const sidecar_t *s, const char *path) {
+    // Write a new file and move it into place, so that an interrupted run
+    // can't leave a half written state behind.
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: failed to write to %s.\n", tmp);
+        return -1;
+    }
+
+    fprintf(fp, "%s %d\n", SIDECAR_MAGIC, SIDECAR_VERSION);
+    fprintf(fp, "format %s\n", s->format);
+    fprintf(fp, "window %s\n", s->window);
+    fprintf(fp, "beta %a\n", s->beta);
+    fprintf(fp, "channels %" PRIu32 "\n", s->channels);
+    fprintf(fp, "fftsize %" PRIu32 "\n", s->fftsize);
+    fprintf(fp, "overlap %" PRIu32 "\n", s->overlap);
+    fprintf(fp, "taps %" PRIu32 "\n", s->taps);
+    fprintf(fp, "offset %" PRIu64 "\n", s->offset);
+    fprintf(fp, "frames %" PRIu64 "\n", s->frames);
+    fprintf(fp, "strips %" PRIu32 "\n", s->strips);
+    fprintf(fp, "maxdb %a\n", s->stats.maxdb);
+    fprintf(fp, "mindb %a\n", s->stats.mindb);
+    fprintf(fp, "maxval %" PRId32 "\n", s->stats.maxval);
+    fprintf(fp, "minval %" PRId32 "\n", s->stats.minval);
+    fprintf(fp, "carry %" PRIu32 "\n", sidecar_carry_len(s));
+    for (uint32_t i = 0; i < sidecar_carry_len(s); i++) {
+        fprintf(fp, "%a %a\n", s->carry[i][0], s->carry[i][1]);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: failed to write to %s.\n", path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void sidecar_free(sidecar_t *s) {
+    free(s->carry);
+    s->carry = NULL;
+}
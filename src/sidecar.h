@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <fftw3.h>
+
+#include "colormap.h"
+
+// State saved next to an output between incremental runs, so that the next
+// run only has to render the input added since. Kept as text, one setting
+// per line, with doubles in hex so they round trip exactly.
+typedef struct {
+    // Settings the render was made with. Later runs must use the same ones.
+    char format[255];
+    char window[255];
+    double beta;
+    uint32_t channels;
+    uint32_t fftsize;
+    uint32_t overlap;
+    // Filterbank branches, 0 for none (and in states saved before they were
+    // supported).
+    uint32_t taps;
+
+    // Byte offset into the input of the first sample not rendered yet.
+    uint64_t offset;
+    // Rows rendered, and strip images written, so far.
+    uint64_t frames;
+    uint32_t strips;
+
+    colormap_stats_t stats;
+    // The render's carry (see waterfall_get_carry()), sidecar_carry_len()
+    // values.
+    fftw_complex *carry;
+} sidecar_t;
+
+// Returns 1 if the state was loaded, 0 if there is no state at path yet, or
+// -1 (after reporting why on stderr) if it couldn't be read.
+int sidecar_load(sidecar_t *s, const char *path);
+
+// Replace the state at path. Returns -1 (after reporting why on stderr) on
+// failure, in which case the previous state is left in place.
+int sidecar_save(const sidecar_t *s, const char *path);
+
+void sidecar_free(sidecar_t *s);
+
+// Values in the carry, across all channels.
+uint32_t sidecar_carry_len(const sidecar_t *s);
@@ -0,0 +1,326 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "spectrum.h"
+
+#define SPECTRUM_MAGIC "RFSPEC\r\n"
+#define SPECTRUM_VERSION 1
+
+// Levels start on a page boundary, after the header.
+#define SPECTRUM_ALIGN 4096
+
+// Bytes of rows written to a level at a time.
+#define SPECTRUM_FLUSH_SIZE (1 << 20)
+
+// Stands in for the dB of bins with no power at all.
+#define SPECTRUM_FLOOR_DB -300.0f
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t fftsize;
+    uint32_t channels;
+    uint64_t frames;
+} spectrum_header_t;
+
+typedef struct {
+    uint32_t width;
+    uint64_t rows;
+    uint64_t offset;
+
+    // Rows waiting to be written, the first of which is row first.
+    float *buf;
+    uint32_t cap;
+    uint32_t nbuf;
+    uint64_t first;
+    uint64_t next_row;
+
+    // Row of this level being folded together from the level before, and how
+    // many rows of that have gone into it.
+    float *fold;
+    uint32_t nfold;
+} level_t;
+
+struct spectrum_writer {
+    spectrum_info_t info;
+    int fd;
+    char *path;
+    level_t levels[SPECTRUM_MAX_LEVELS];
+    float *row;
+    arena_t *arena;
+    bool failed;
+};
+
+void spectrum_info_init(spectrum_info_t *info, uint32_t fftsize,
+                        uint32_t channels, uint64_t frames) {
+    info->fftsize = fftsize;
+    info->channels = channels;
+    info->width = fftsize * channels;
+    info->frames = frames;
+    info->levels = 1;
+    while (info->levels < SPECTRUM_MAX_LEVELS &&
+           (spectrum_level_width(info, info->levels - 1) > SPECTRUM_TILE ||
+            spectrum_level_rows(info, info->levels - 1) > SPECTRUM_TILE)) {
+        info->levels++;
+    }
+}
+
+uint32_t spectrum_level_width(const spectrum_info_t *info, uint32_t level) {
+    return (uint32_t)(((uint64_t)info->width + (1ull << level) - 1) >> level);
+}
+
+uint64_t spectrum_level_rows(const spectrum_info_t *info, uint32_t level) {
+    return (info->frames + (1ull << level) - 1) >> level;
+}
+
+// Byte offset of every level, and the size of the whole cache.
+static uint64_t layout(const spectrum_info_t *info, uint64_t *offsets) {
+    uint64_t pos = SPECTRUM_ALIGN;
+    for (uint32_t l = 0; l < info->levels; l++) {
+        offsets[l] = pos;
+        pos += spectrum_level_rows(info, l) * spectrum_level_width(info, l) *
+               sizeof(float);
+        pos = (pos + SPECTRUM_ALIGN - 1) / SPECTRUM_ALIGN * SPECTRUM_ALIGN;
+    }
+    return pos;
+}
+
+// Rows of a level buffered before they're written.
+static uint32_t level_cap(uint32_t width) {
+    uint32_t cap = SPECTRUM_FLUSH_SIZE / (width * sizeof(float));
+    return (cap > 0) ? cap : 1;
+}
+
+size_t spectrum_writer_memory(const spectrum_info_t *info) {
+    size_t size = arena_footprint(info->width * sizeof(float));
+    for (uint32_t l = 0; l < info->levels; l++) {
+        uint32_t width = spectrum_level_width(info, l);
+        size += arena_footprint((size_t)level_cap(width) * width *
+                                sizeof(float)) +
+                arena_footprint(width * sizeof(float));
+    }
+    return size;
+}
+
+// Buffers come out of the arena if there is one, and it has room.
+static float *alloc_floats(spectrum_writer_t *w, size_t n) {
+    float *p = w->arena ? (float *)arena_alloc(w->arena, n * sizeof(float))
+                        : NULL;
+    return p ? p : (float *)malloc(n * sizeof(float));
+}
+
+static void free_floats(spectrum_writer_t *w, float *p) {
+    if (!w->arena || !arena_owns(w->arena, p))
+        free(p);
+}
+
+static void flush_level(spectrum_writer_t *w, level_t *lv) {
+    size_t len = (size_t)lv->nbuf * lv->width * sizeof(float);
+    off_t off = lv->offset + lv->first * lv->width * sizeof(float);
+    const uint8_t *p = (const uint8_t *)lv->buf;
+    while (len > 0) {
+        ssize_t n = pwrite(w->fd, p, len, off);
+        if (n <= 0) {
+            w->failed = true;
+            break;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    lv->first += lv->nbuf;
+    lv->nbuf = 0;
+}
+
+static void reset_fold(level_t *lv) {
+    for (uint32_t x = 0; x < lv->width; x++) {
+        lv->fold[x] = -INFINITY;
+    }
+    lv->nfold = 0;
+}
+
+// Add the next row of a level, and fold it into the level after.
+static void emit_row(spectrum_writer_t *w, uint32_t l, const float *row) {
+    level_t *lv = &w->levels[l];
+    uint64_t y = lv->next_row++;
+
+    memcpy(lv->buf + ((size_t)lv->nbuf * lv->width), row,
+           lv->width * sizeof(float));
+    if (++lv->nbuf == lv->cap) {
+        flush_level(w, lv);
+    }
+
+    if (l + 1 == w->info.levels) {
+        return;
+    }
+    level_t *next = &w->levels[l + 1];
+    for (uint32_t x = 0; x < next->width; x++) {
+        float v = row[2 * x];
+        if (2 * x + 1 < lv->width && row[2 * x + 1] > v)
+            v = row[2 * x + 1];
+        if (v > next->fold[x])
+            next->fold[x] = v;
+    }
+    // A level with an odd number of rows ends on a row folded from one.
+    if (++next->nfold == 2 || y + 1 == lv->rows) {
+        emit_row(w, l + 1, next->fold);
+        reset_fold(next);
+    }
+}
+
+spectrum_writer_t *spectrum_create(const char *path,
+                                   const spectrum_info_t *info,
+                                   arena_t *arena) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: failed to write to %s.\n", path);
+        return NULL;
+    }
+
+    uint64_t offsets[SPECTRUM_MAX_LEVELS];
+    uint64_t size = layout(info, offsets);
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "Error: failed to allocate %s.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    spectrum_writer_t *w =
+        (spectrum_writer_t *)calloc(1, sizeof(spectrum_writer_t));
+    w->info = *info;
+    w->fd = fd;
+    w->path = strdup(path);
+    w->arena = arena;
+    for (uint32_t l = 0; l < info->levels; l++) {
+        level_t *lv = &w->levels[l];
+        lv->width = spectrum_level_width(info, l);
+        lv->rows = spectrum_level_rows(info, l);
+        lv->offset = offsets[l];
+        lv->cap = level_cap(lv->width);
+        lv->buf = alloc_floats(w, (size_t)lv->cap * lv->width);
+        lv->fold = alloc_floats(w, lv->width);
+        reset_fold(lv);
+    }
+    w->row = alloc_floats(w, info->width);
+    return w;
+}
+
+void spectrum_write_rows(void *userdata, uint32_t y, uint32_t nrows,
+                         const float *power) {
+    spectrum_writer_t *w = (spectrum_writer_t *)userdata;
+    uint32_t width = w->info.width;
+    for (uint32_t i = 0; i < nrows && y + i < w->info.frames; i++) {
+        const float *p = power + ((size_t)i * width);
+        for (uint32_t x = 0; x < width; x++) {
+            w->row[x] =
+                (p[x] > 0) ? 10.0f * log10f(p[x]) : SPECTRUM_FLOOR_DB;
+        }
+        emit_row(w, 0, w->row);
+    }
+}
+
+int spectrum_finish(spectrum_writer_t *w) {
+    // A render that came up short leaves partly folded rows behind.
+    for (uint32_t l = 1; l < w->info.levels; l++) {
+        if (w->levels[l].nfold > 0) {
+            emit_row(w, l, w->levels[l].fold);
+        }
+    }
+    for (uint32_t l = 0; l < w->info.levels; l++) {
+        flush_level(w, &w->levels[l]);
+    }
+
+    // The header goes last, so an unfinished cache is never mistaken for one.
+    spectrum_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SPECTRUM_MAGIC, sizeof(hdr.magic));
+    hdr.version = SPECTRUM_VERSION;
+    hdr.width = w->info.width;
+    hdr.fftsize = w->info.fftsize;
+    hdr.channels = w->info.channels;
+    hdr.frames = w->info.frames;
+    if (pwrite(w->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        w->failed = true;
+    }
+    if (close(w->fd) < 0) {
+        w->failed = true;
+    }
+
+    int ret = 0;
+    if (w->failed) {
+        fprintf(stderr, "Error: failed to write to %s.\n", w->path);
+        ret = -1;
+    }
+    for (uint32_t l = 0; l < w->info.levels; l++) {
+        free_floats(w, w->levels[l].buf);
+        free_floats(w, w->levels[l].fold);
+    }
+    free_floats(w, w->row);
+    free(w->path);
+    free(w);
+    return ret;
+}
+
+int spectrum_open(spectrum_t *s, const char *path) {
+    memset(s, 0, sizeof(spectrum_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: failed to read %s.\n", path);
+        return -1;
+    }
+
+    spectrum_header_t hdr;
+    struct stat st;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, SPECTRUM_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != SPECTRUM_VERSION || hdr.channels == 0 ||
+        hdr.width != hdr.fftsize * hdr.channels || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: %s is not a spectral cache.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    spectrum_info_init(&s->info, hdr.fftsize, hdr.channels, hdr.frames);
+    uint64_t size = layout(&s->info, s->level_offset);
+    if ((uint64_t)st.st_size < size) {
+        fprintf(stderr, "Error: %s is truncated.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    s->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map %s.\n", path);
+        s->map = NULL;
+        return -1;
+    }
+    s->map_len = size;
+    // Tiles pull in scattered rows; reading ahead would mostly be wasted.
+    madvise(s->map, size, MADV_RANDOM);
+    return 0;
+}
+
+void spectrum_close(spectrum_t *s) {
+    if (s->map) {
+        munmap(s->map, s->map_len);
+        s->map = NULL;
+    }
+}
+
+const float *spectrum_row(const spectrum_t *s, uint32_t level, uint64_t row) {
+    return (const float *)((const uint8_t *)s->map + s->level_offset[level] +
+                           row * spectrum_level_width(&s->info, level) *
+                               sizeof(float));
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// Tiles are this many pixels (bins by frames) square.
+#define SPECTRUM_TILE 256
+
+// Levels are capped here, which is more than 2^32 rows can use.
+#define SPECTRUM_MAX_LEVELS 64
+
+// A spectral cache: the power of every bin of every frame of a render, in dB,
+// followed by a pyramid of coarser levels for zoomed out views. Each level
+// keeps the loudest of every 2 x 2 values of the one before, so signals stay
+// visible all the way out. Levels stop once one fits in a single tile.
+typedef struct {
+    // Bins per row (fftsize * channels), and rows, at full resolution.
+    uint32_t width;
+    uint64_t frames;
+    uint32_t fftsize;
+    uint32_t channels;
+    uint32_t levels;
+} spectrum_info_t;
+
+void spectrum_info_init(spectrum_info_t *info, uint32_t fftsize,
+                        uint32_t channels, uint64_t frames);
+uint32_t spectrum_level_width(const spectrum_info_t *info, uint32_t level);
+uint64_t spectrum_level_rows(const spectrum_info_t *info, uint32_t level);
+
+typedef struct spectrum_writer spectrum_writer_t;
+
+// Create a cache at path for a render of frames rows, with its write buffers
+// out of arena if there is one. Returns NULL (after reporting why on stderr)
+// on failure.
+spectrum_writer_t *spectrum_create(const char *path,
+                                   const spectrum_info_t *info,
+                                   arena_t *arena);
+
+// Bytes a writer takes out of its arena.
+size_t spectrum_writer_memory(const spectrum_info_t *info);
+
+// Add nrows rows of power, starting at row y. Rows must come in order. Has
+// the same signature as waterfall_power_fn.
+void spectrum_write_rows(void *userdata, uint32_t y, uint32_t nrows,
+                         const float *power);
+
+// Finish the coarser levels and close the cache. Returns -1 (after reporting
+// why on stderr) if anything failed to write.
+int spectrum_finish(spectrum_writer_t *w);
+
+// A cache mapped for reading.
+typedef struct {
+    spectrum_info_t info;
+    void *map;
+    size_t map_len;
+    // Byte offset of each level in the map.
+    uint64_t level_offset[SPECTRUM_MAX_LEVELS];
+} spectrum_t;
+
+// Returns -1 (after reporting why on stderr) on failure.
+int spectrum_open(spectrum_t *s, const char *path);
+void spectrum_close(spectrum_t *s);
+
+// Row of a level, spectrum_level_width() values.
+const float *spectrum_row(const spectrum_t *s, uint32_t level, uint64_t row);
@@ -0,0 +1,151 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tilecache.h"
+
+// Hash table buckets (a power of 2).
+#define TILE_BUCKETS 16384
+
+struct tile_cache {
+    pthread_mutex_t lock;
+    tile_t *buckets[TILE_BUCKETS];
+    // Most recently used at head.
+    tile_t *head, *tail;
+    size_t size;
+    size_t capacity;
+};
+
+static uint32_t hash_key(const char *key) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *key; key++) {
+        h = (h ^ (uint8_t)*key) * 16777619u;
+    }
+    return h & (TILE_BUCKETS - 1);
+}
+
+tile_cache_t *tile_cache_create(size_t capacity) {
+    tile_cache_t *cache = (tile_cache_t *)calloc(1, sizeof(tile_cache_t));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->capacity = capacity;
+    return cache;
+}
+
+static void free_tile(tile_t *tile) {
+    free(tile->data);
+    free(tile);
+}
+
+void tile_cache_destroy(tile_cache_t *cache) {
+    tile_t *tile = cache->head;
+    while (tile) {
+        tile_t *next = tile->next;
+        free_tile(tile);
+        tile = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static void unlink_lru(tile_cache_t *cache, tile_t *tile) {
+    if (tile->prev)
+        tile->prev->next = tile->next;
+    else
+        cache->head = tile->next;
+    if (tile->next)
+        tile->next->prev = tile->prev;
+    else
+        cache->tail = tile->prev;
+    tile->prev = tile->next = NULL;
+}
+
+static void push_lru(tile_cache_t *cache, tile_t *tile) {
+    tile->prev = NULL;
+    tile->next = cache->head;
+    if (cache->head)
+        cache->head->prev = tile;
+    else
+        cache->tail = tile;
+    cache->head = tile;
+}
+
+static tile_t *find(tile_cache_t *cache, const char *key) {
+    tile_t *tile = cache->buckets[hash_key(key)];
+    while (tile && strcmp(tile->key, key)) {
+        tile = tile->hash_next;
+    }
+    return tile;
+}
+
+// Drop a tile from the table and list. It's freed once nobody is using it.
+static void evict(tile_cache_t *cache, tile_t *tile) {
+    tile_t **p = &cache->buckets[hash_key(tile->key)];
+    while (*p != tile) {
+        p = &(*p)->hash_next;
+    }
+    *p = tile->hash_next;
+    unlink_lru(cache, tile);
+    cache->size -= tile->len;
+    tile->cached = false;
+    if (tile->refs == 0) {
+        free_tile(tile);
+    }
+}
+
+tile_t *tile_cache_get(tile_cache_t *cache, const char *key) {
+    pthread_mutex_lock(&cache->lock);
+    tile_t *tile = find(cache, key);
+    if (tile) {
+        unlink_lru(cache, tile);
+        push_lru(cache, tile);
+        tile->refs++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return tile;
+}
+
+tile_t *tile_cache_put(tile_cache_t *cache, const char *key, uint8_t *data,
+                       size_t len) {
+    tile_t *tile = (tile_t *)calloc(1, sizeof(tile_t));
+    snprintf(tile->key, sizeof(tile->key), "%s", key);
+    tile->data = data;
+    tile->len = len;
+    tile->refs = 1;
+
+    pthread_mutex_lock(&cache->lock);
+    // Another worker may have rendered the same tile in the meantime; keep
+    // theirs.
+    tile_t *old = find(cache, key);
+    if (old) {
+        old->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        free_tile(tile);
+        return old;
+    }
+    if (len <= cache->capacity) {
+        while (cache->size + len > cache->capacity) {
+            evict(cache, cache->tail);
+        }
+        uint32_t h = hash_key(key);
+        tile->hash_next = cache->buckets[h];
+        cache->buckets[h] = tile;
+        push_lru(cache, tile);
+        cache->size += len;
+        tile->cached = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return tile;
+}
+
+void tile_release(tile_cache_t *cache, tile_t *tile) {
+    pthread_mutex_lock(&cache->lock);
+    bool gone = (--tile->refs == 0) && !tile->cached;
+    pthread_mutex_unlock(&cache->lock);
+    if (gone) {
+        free_tile(tile);
+    }
+}
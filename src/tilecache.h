@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest tile key, including the terminator.
+#define TILE_KEY_SIZE 96
+
+// An encoded tile. Tiles handed out by the cache stay valid until released,
+// even if the cache drops them in the meantime.
+typedef struct tile {
+    char key[TILE_KEY_SIZE];
+    uint8_t *data;
+    size_t len;
+
+    uint32_t refs;
+    // Whether the tile is still in the cache's table and LRU list.
+    bool cached;
+    struct tile *hash_next;
+    struct tile *prev, *next;
+} tile_t;
+
+// A thread safe LRU cache of encoded tiles, up to a total size in bytes.
+typedef struct tile_cache tile_cache_t;
+
+tile_cache_t *tile_cache_create(size_t capacity);
+void tile_cache_destroy(tile_cache_t *cache);
+
+// Returns the tile cached for key, or NULL.
+tile_t *tile_cache_get(tile_cache_t *cache, const char *key);
+
+// Cache data (taking ownership of it, to be free()d) for key, dropping the
+// least recently used tiles to make room. Returns the new tile.
+tile_t *tile_cache_put(tile_cache_t *cache, const char *key, uint8_t *data,
+                       size_t len);
+
+// Done with a tile returned by tile_cache_get() or tile_cache_put().
+void tile_release(tile_cache_t *cache, tile_t *tile);
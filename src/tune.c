@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "affinity.h"
+#include "formats.h"
+#include "pngout.h"
+#include "profile.h"
+#include "reader.h"
+#include "tune.h"
+#include "waterfall.h"
+
+// Most FFT sizes tuned in one go.
+#define MAX_SIZES PROFILE_MAX_ENTRIES
+
+// Default --clip: samples rendered by each calibration run.
+#define DEFAULT_SAMPLES (4 << 20)
+
+// Each calibration run is repeated, keeping the fastest, to ride out noise.
+#define TUNE_REPEATS 2
+
+// Settings are tried cheapest first, and a dearer one only wins if it's
+// this much faster.
+#define TUNE_MARGIN 0.03
+
+// Bytes of synthetic capture written at a time.
+#define SYNTH_CHUNK (1 << 20)
+
+static const uint32_t default_sizes[] = {256, 1024, 4096, 16384, 65536};
+
+static const planner_t planners[] = {PLANNER_ESTIMATE, PLANNER_MEASURE,
+                                     PLANNER_PATIENT};
+
+static const uint32_t batch_sizes[] = {4, 16, 64};
+
+static const size_t block_sizes[] = {256 << 10, 1 << 20, 4 << 20};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void swap_bytes(uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n / 2; i++) {
+        uint8_t t = p[i];
+        p[i] = p[n - 1 - i];
+        p[n - 1 - i] = t;
+    }
+}
+
+// Fill buf with len bytes of white noise in format. Every bit pattern is a
+// valid sample in the integer and packed formats, so those are random bytes;
+// the float formats get values of about -20 dBFS.
+static void synth_fill(format_t format, uint8_t *buf, size_t len,
+                       uint64_t *state) {
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t x = xorshift(state);
+        memcpy(buf + i, &x, 8);
+    }
+
+    bool be = (format == FORMAT_FLOAT32BE || format == FORMAT_FLOAT64BE);
+    size_t size = format_sample_size(format) / 2;
+    if (format == FORMAT_FLOAT32 || format == FORMAT_FLOAT32BE) {
+        for (size_t i = 0; i + size <= len; i += size) {
+            float v = (float)((double)(int32_t)xorshift(state) / 2e10);
+            memcpy(buf + i, &v, size);
+            if (be)
+                swap_bytes(buf + i, size);
+        }
+    } else if (format == FORMAT_FLOAT64 || format == FORMAT_FLOAT64BE) {
+        for (size_t i = 0; i + size <= len; i += size) {
+            double v = (double)(int32_t)xorshift(state) / 2e10;
+            memcpy(buf + i, &v, size);
+            if (be)
+                swap_bytes(buf + i, size);
+        }
+    }
+}
+
+// Write a synthetic capture of samples samples to a new file in dir, putting
+// its name in path. Returns -1 (after reporting why on stderr) on failure.
+static int synth_write(char *path, size_t size, const char *dir,
+                       format_t format, uint64_t samples) {
+    snprintf(path, size, "%s/renderfall-tune-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: failed to create a file in %s.\n", dir);
+        return -1;
+    }
+
+    uint64_t left = samples * format_sample_size(format);
+    uint8_t *buf = (uint8_t *)malloc(SYNTH_CHUNK);
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    int ret = 0;
+    while (left > 0 && ret == 0) {
+        size_t len = (left < SYNTH_CHUNK) ? (size_t)left : SYNTH_CHUNK;
+        synth_fill(format, buf, len, &state);
+        if (write(fd, buf, len) != (ssize_t)len) {
+            fprintf(stderr, "Error: failed to write to %s.\n", path);
+            ret = -1;
+        }
+        left -= len;
+    }
+    free(buf);
+    if (fsync(fd) < 0) {
+        ret = -1;
+    }
+    close(fd);
+    if (ret < 0) {
+        unlink(path);
+    }
+    return ret;
+}
+
+// Have the next run read the capture from the disk rather than the page
+// cache, so that the disk's speed is part of the measurement.
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void write_rows(void *userdata, uint32_t y, uint32_t nrows,
+                       const uint8_t *rows) {
+    png_out_t *png = (png_out_t *)userdata;
+    (void)y;
+    for (uint32_t i = 0; i < nrows; i++) {
+        png_out_write_row(png, rows);
+        rows += png_get_rowbytes(png->png_ptr, png->info_ptr);
+    }
+}
+
+// Render the synthetic capture with the settings in e, through every stage
+// from reading it to encoding the image (which is thrown away). Returns the
+// rate in samples per second, not counting planning, or -1 (after reporting
+// why on stderr) if the render failed.
+static double calibrate(const char *path, format_t format, uint64_t samples,
+                        const profile_entry_t *e) {
+    waterfall_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.format = format;
+    params.window = "blackman";
+    params.fftsize = e->fftsize;
+    params.threads = e->threads;
+    params.rows_per_block = e->rows_per_block;
+    params.planner = e->planner;
+
+    double best = 0;
+    for (int rep = 0; rep < TUNE_REPEATS; rep++) {
+        png_out_t png;
+        waterfall_t *wf = waterfall_create(&params, write_rows, &png);
+        if (!wf) {
+            fprintf(stderr, "Error: failed to set up an FFT of size %d.\n",
+                    e->fftsize);
+            return -1;
+        }
+        uint32_t rows = (uint32_t)waterfall_rows(&params, samples);
+        if (png_out_open(&png, "/dev/null", e->fftsize, rows, NULL) < 0) {
+            waterfall_destroy(wf);
+            return -1;
+        }
+        drop_cache(path);
+
+        double start = now();
+        placement_t anywhere = {-1, -1};
+        char *paths[1] = {(char *)path};
+        reader_t *reader = reader_open(paths, 1, 0, anywhere, e->block_size,
+                                       NULL);
+        const uint8_t *block;
+        size_t len;
+        while ((len = reader_next(reader, &block)) > 0) {
+            waterfall_push(wf, block, len);
+        }
+        waterfall_finish(wf);
+        bool failed = reader_failed(reader);
+        reader_close(reader);
+        failed |= (png_out_close(&png) < 0);
+        double rate = samples / (now() - start);
+
+        waterfall_destroy(wf);
+        if (failed)
+            return -1;
+        if (rate > best)
+            best = rate;
+    }
+    return best;
+}
+
+// Time the settings in candidate, and make them the best if they beat it by
+// enough. Returns -1 if the calibration run failed.
+static int try_settings(profile_entry_t *best, profile_entry_t *candidate,
+                        const char *path, format_t format, uint64_t samples,
+                        bool verbose) {
+    candidate->rate = calibrate(path, format, samples, candidate);
+    if (candidate->rate < 0)
+        return -1;
+    if (verbose)
+        printf("  %d threads, %d rows per batch, %s planner, %zuK blocks: "
+               "%.2f Msamples/s\n",
+               candidate->threads, candidate->rows_per_block,
+               planner_name(candidate->planner), candidate->block_size >> 10,
+               candidate->rate / 1e6);
+    if (best->rate == 0 || candidate->rate > best->rate * (1 + TUNE_MARGIN)) {
+        *best = *candidate;
+    }
+    return 0;
+}
+
+// Find the fastest settings for one FFT size, a stage at a time: the
+// planner, then threads and batch size together, then the read block size.
+// Returns -1 if a calibration run failed.
+static int tune_size(profile_entry_t *result, uint32_t fftsize,
+                     const char *path, format_t format, uint64_t samples,
+                     uint32_t max_threads, bool verbose) {
+    profile_entry_t best, e;
+    memset(&best, 0, sizeof(best));
+    best.fftsize = fftsize;
+    best.block_size = READ_BLOCK_SIZE;
+
+    for (size_t i = 0; i < COUNT(planners); i++) {
+        e = best;
+        e.planner = planners[i];
+        if (try_settings(&best, &e, path, format, samples, verbose) < 0)
+            return -1;
+    }
+
+    // Fewer threads first, so that extra ones only win if they pay off.
+    profile_entry_t base = best;
+    for (uint32_t t = 1; t <= max_threads; t *= 2) {
+        // Always finish on max_threads, even if it isn't a power of 2.
+        if (t * 2 > max_threads)
+            t = max_threads;
+        for (size_t i = 0; i < COUNT(batch_sizes); i++) {
+            e = base;
+            e.threads = t;
+            e.rows_per_block = batch_sizes[i];
+            if (try_settings(&best, &e, path, format, samples, verbose) < 0)
+                return -1;
+        }
+    }
+
+    base = best;
+    for (size_t i = 0; i < COUNT(block_sizes); i++) {
+        if (block_sizes[i] == base.block_size)
+            continue;
+        e = base;
+        e.block_size = block_sizes[i];
+        if (try_settings(&best, &e, path, format, samples, verbose) < 0)
+            return -1;
+    }
+    *result = best;
+    return 0;
+}
+
+// Parse a comma separated list of FFT sizes. Returns the number of sizes, or
+// -1 if the list is malformed.
+static int parse_sizes(char *arg, uint32_t *sizes) {
+    int n = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(arg, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        unsigned long size = strtoul(tok, &end, 0);
+        if (*end || size < 2 || size > (1u << 24) || (size & (size - 1)) ||
+            n == MAX_SIZES) {
+            return -1;
+        }
+        sizes[n++] = (uint32_t)size;
+    }
+    return n;
+}
+
+static void tune_usage(char *arg) {
+    fprintf(stderr, "Usage: %s tune [OPTIONS]\n", arg);
+    fprintf(stderr, "Find the fastest settings for this host, and save them "
+                    "to the profile used by later renders.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -n, --fftsize <list>\tFFT sizes to tune (defaults to "
+                    "256,1024,4096,16384,65536)\n");
+    fprintf(stderr, "  -f, --format <format>\tInput format to tune for "
+                    "(defaults to float32)\n");
+    fprintf(stderr, "  -t, --threads <n>\tMost worker threads to try "
+                    "(defaults to the number of CPUs)\n");
+    fprintf(stderr, "  -c, --clip <clip>\tSamples per calibration run "
+                    "(defaults to 4194304)\n");
+    fprintf(stderr, "  -d, --dir <dir>\tWrite the synthetic capture here, "
+                    "e.g. on the capture disk (defaults to $TMPDIR)\n");
+    fprintf(stderr, "  -o, --outfile <file>\tSave the profile here (defaults "
+                    "to $RENDERFALL_PROFILE, or ~/.config/renderfall/profile)"
+                    "\n");
+    fprintf(stderr, "  -v, --verbose \t\tPrint every calibration run\n");
+}
+
+int tune_main(int argc, char *argv[]) {
+    int verbose = 0;
+    uint32_t sizes[MAX_SIZES];
+    int nsizes = COUNT(default_sizes);
+    memcpy(sizes, default_sizes, sizeof(default_sizes));
+    format_t format = FORMAT_FLOAT32;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t max_threads = (cpus > 0) ? (uint32_t)cpus : 1;
+    uint64_t samples = DEFAULT_SAMPLES;
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX] = "";
+
+    struct option long_options[] = {{"verbose", no_argument, &verbose, 1},
+                                    {"help", no_argument, NULL, 'h'},
+                                    {"fftsize", required_argument, NULL, 'n'},
+                                    {"format", required_argument, NULL, 'f'},
+                                    {"threads", required_argument, NULL, 't'},
+                                    {"clip", required_argument, NULL, 'c'},
+                                    {"dir", required_argument, NULL, 'd'},
+                                    {"outfile", required_argument, NULL, 'o'},
+                                    {0, 0, 0, 0}};
+
+    int c, option_index;
+    char *end;
+    while ((c = getopt_long(argc, argv, "hvn:f:t:c:d:o:", long_options,
+                            &option_index)) != -1) {
+        switch (c) {
+        case 0:
+            break;
+        case 'h':
+            tune_usage(argv[0]);
+            return EXIT_SUCCESS;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            nsizes = parse_sizes(optarg, sizes);
+            if (nsizes <= 0) {
+                fprintf(stderr, "Invalid FFT sizes: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            if (parse_format(&format, optarg) < 0) {
+                fprintf(stderr, "Unknown format: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            max_threads = (uint32_t)strtoul(optarg, &end, 0);
+            if (*end) {
+                fprintf(stderr, "Invalid value for threads\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            samples = strtoull(optarg, &end, 0);
+            if (*end || samples == 0) {
+                fprintf(stderr, "Invalid value for clip\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'o':
+            snprintf(path, sizeof(path), "%s", optarg);
+            break;
+        default:
+            tune_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc) {
+        tune_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!strcmp(path, "") && !profile_default_path(path, sizeof(path))) {
+        fprintf(stderr, "Nowhere to save the profile; use -o.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Start from the profile already there, so that sizes tuned earlier are
+    // kept.
+    profile_t profile;
+    if (profile_load(&profile, path) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    char capture[PATH_MAX];
+    uint32_t largest = 0;
+    for (int i = 0; i < nsizes; i++) {
+        if (sizes[i] > largest)
+            largest = sizes[i];
+    }
+    // Enough for a few dozen rows at the largest size.
+    if (samples < 64ull * largest)
+        samples = 64ull * largest;
+    if (synth_write(capture, sizeof(capture), dir ? dir : "/tmp", format,
+                    samples) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (verbose)
+        printf("Calibrating with %" PRIu64 " samples in %s.\n", samples,
+               capture);
+
+    for (int i = 0; i < nsizes; i++) {
+        if (verbose)
+            printf("FFT size %d:\n", sizes[i]);
+        profile_entry_t best;
+        if (tune_size(&best, sizes[i], capture, format, samples, max_threads,
+                      verbose) < 0) {
+            fprintf(stderr, "Error: calibration failed for FFT size %d.\n",
+                    sizes[i]);
+            unlink(capture);
+            return EXIT_FAILURE;
+        }
+        printf("%6d: %d threads, %d rows per batch, %s planner, %zuK blocks "
+               "(%.2f Msamples/s)\n",
+               best.fftsize, best.threads, best.rows_per_block,
+               planner_name(best.planner), best.block_size >> 10,
+               best.rate / 1e6);
+        profile_set(&profile, &best);
+    }
+    unlink(capture);
+    waterfall_cleanup();
+
+    if (profile_save(&profile, path) < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("Saved profile to %s.\n", path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Entry point for "renderfall tune": time short renders of a synthetic
+// capture with different settings, and save the fastest for each FFT size to
+// the profile (see profile.h). Takes the arguments following "tune", with the
+// program name in argv[0].
+int tune_main(int argc, char *argv[]);
@@ -1,83 +1,838 @@
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <fftw3.h>
-#include <png.h>
 
+#include "affinity.h"
+#include "arena.h"
 #include "colormap.h"
-#include "shell.h"
+#include "ddc.h"
+#include "detect.h"
+#include "pool.h"
 #include "waterfall.h"
+#include "window.h"
 
-void shiftleft(fftw_complex arr[], uint32_t size, uint32_t shift) {
-    for (uint32_t i = 0; i < (size - shift); i++) {
-        arr[i][0] = arr[i + shift][0];
-        arr[i][1] = arr[i + shift][1];
+// Samples converted at a time ahead of the downconverter.
+#define DDC_BLOCK_SIZE 4096
+
+// Frames per batch when threaded and the caller doesn't say.
+#define DEFAULT_THREADED_BATCH 16
+
+// Batches in flight per worker: one being rendered, one queued behind it.
+#define SLOTS_PER_WORKER 2
+
+// The FFTW planner isn't thread safe, so planning is serialized across all
+// contexts. Executing plans is safe. The lock also covers the caches below.
+static pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Plans and windows are kept for the life of the process, and shared by every
+// context with the same settings, so that renders after the first skip
+// planning and building the window. Plans are only ever executed
+// through fftw_execute_dft(), so sharing them is safe.
+typedef struct cached_plan {
+    uint32_t size;
+    planner_t planner;
+    fftw_plan plan;
+    struct cached_plan *next;
+} cached_plan_t;
+
+typedef struct cached_window {
+    char name[64];
+    uint32_t size;
+    uint32_t taps;
+    double beta;
+    window_t win;
+    struct cached_window *next;
+} cached_window_t;
+
+static cached_plan_t *plan_cache;
+static cached_window_t *window_cache;
+
+typedef enum {
+    SLOT_FREE = 0,
+    SLOT_QUEUED,
+    SLOT_DONE,
+} slot_state_t;
+
+// A batch of frames, and the rows they render to. Each frame holds one
+// frame_len run of samples per channel, each of which is one fftsize
+// transform. Each slot is always queued on the same worker, and lives on
+// that worker's node. An idle worker on the same node may render it instead
+// (see pool_submit()), with its own worker state, so the buffers stay local.
+typedef struct {
+    waterfall_t *wf;
+    uint32_t worker;
+    fftw_complex *frames;
+    uint8_t *rows;
+    // Power of every bin, for the detector and power callback (NULL without
+    // either).
+    float *power;
+    uint32_t nframes;
+    uint32_t y;
+    slot_state_t state;
+} slot_t;
+
+// Everything a worker touches while rendering, on the worker's node.
+typedef struct {
+    placement_t placement;
+    window_t win;
+    fftw_complex *inter, *out;
+    colormap_stats_t stats;
+} worker_state_t;
+
+struct waterfall {
+    waterfall_params_t params;
+    window_t win;
+    uint32_t channels;
+    // One downconverter per channel, or NULL.
+    ddc_t **ddc;
+
+    waterfall_rows_fn rows_fn;
+    void *userdata;
+
+    convert_samples_fn convert;
+    size_t sample_size;
+    // Bytes per sample across all channels.
+    size_t stride;
+
+    // Leading bytes of a sample split across two pushes.
+    uint8_t *partial;
+    size_t partial_len;
+
+    fftw_plan plan;
+    uint32_t batch;
+
+    // Samples per channel in each frame (taps * fftsize with a filterbank),
+    // and how many of them the next frame starts with.
+    uint32_t frame_len;
+    uint32_t carry_len;
+
+    // Workers, and the pool running them (NULL when rendering inline, in
+    // which case there is a single worker state). The pool is only ours to
+    // destroy if we started it.
+    uint32_t nworkers;
+    worker_state_t *workers;
+    placement_t *placement;
+    pool_t *pool;
+    bool own_pool;
+
+    // Ring of batches. Slots are filled at tail and delivered at head, both in
+    // order, so rows always come out in order.
+    uint32_t nslots;
+    slot_t *slots;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t inflight;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Frame being assembled in the tail slot, and how many samples of it are
+    // filled in (the same for every channel). The tail of each frame is
+    // carried over to the next one.
+    fftw_complex *frame;
+    uint32_t fill;
+    fftw_complex *carry;
+    uint32_t next_y;
+
+    // Downconverter input block, and output blocks for each channel.
+    fftw_complex *ddc_in, *ddc_out;
+    uint32_t ddc_out_len;
+
+    uint64_t consumed;
+    bool done;
+    // Continuing an earlier render, so the carry isn't silence.
+    bool resumed;
+
+    // Runs over each batch's power, in order, as it's delivered. The first
+    // frames start with the silence before the input, and are skipped.
+    detector_t *detector;
+    uint64_t detect_skip;
+
+    // Receives each batch's power, in order, as it's delivered.
+    waterfall_power_fn power_fn;
+    void *power_userdata;
+
+    colormap_stats_t stats;
+};
+
+uint64_t waterfall_rows(const waterfall_params_t *params, uint64_t nsamples) {
+    if ((params->clip > 0) && (nsamples > params->clip)) {
+        nsamples = params->clip;
+    }
+    if (params->bandwidth > 0) {
+        nsamples /= ddc_decimation(params->bandwidth);
+    }
+    return nsamples / (params->fftsize - params->overlap);
+}
+
+// Buffers come out of the caller's arena when there is one (and go back only
+// when it's destroyed), or else from the node they're used on. Buffers that
+// don't fit in the arena come from the node after all.
+static void *wf_alloc(waterfall_t *wf, size_t size, int node) {
+    void *p = NULL;
+    if (wf->params.arena) {
+        p = arena_alloc(wf->params.arena, size);
     }
+    return p ? p : node_alloc(size, node);
+}
+
+static void wf_free(waterfall_t *wf, void *p, size_t size, int node) {
+    if (!wf->params.arena || !arena_owns(wf->params.arena, p)) {
+        node_free(p, size, node);
+    }
+}
+
+static void init_worker(waterfall_t *wf, worker_state_t *ws,
+                        placement_t placement) {
+    uint32_t n = wf->params.fftsize;
+    int node = placement.node;
+
+    ws->placement = placement;
+    ws->win.size = wf->win.size;
+    ws->win.coeffs =
+        (double *)wf_alloc(wf, wf->win.size * sizeof(double), node);
+    memcpy(ws->win.coeffs, wf->win.coeffs, wf->win.size * sizeof(double));
+    ws->inter = (fftw_complex *)wf_alloc(wf, n * sizeof(fftw_complex), node);
+    ws->out = (fftw_complex *)wf_alloc(wf, n * sizeof(fftw_complex), node);
+    colormap_stats_init(&ws->stats);
 }
 
-void waterfall(png_structp png_ptr, FILE *fp, waterfall_params_t params) {
-    png_bytep row = (png_bytep)malloc(3 * params.fftsize * sizeof(png_byte));
+static void free_worker(waterfall_t *wf, worker_state_t *ws) {
+    uint32_t n = wf->params.fftsize;
+    int node = ws->placement.node;
 
-    fftw_complex *in, *out, *inter;
-    fftw_plan p;
+    wf_free(wf, ws->win.coeffs, ws->win.size * sizeof(double), node);
+    wf_free(wf, ws->inter, n * sizeof(fftw_complex), node);
+    wf_free(wf, ws->out, n * sizeof(fftw_complex), node);
+}
+
+static size_t slot_frames_size(const waterfall_t *wf) {
+    return sizeof(fftw_complex) * wf->frame_len * wf->channels * wf->batch;
+}
 
-    in = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * params.fftsize);
-    inter = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * params.fftsize);
-    out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * params.fftsize);
-    p = fftw_plan_dft_1d(params.fftsize, inter, out, FFTW_FORWARD,
-                         FFTW_PATIENT);
+static size_t slot_rows_size(const waterfall_t *wf) {
+    return 3 * wf->params.fftsize * wf->channels * wf->batch;
+}
 
-    uint32_t half = params.fftsize / 2;
-    uint32_t x, y;
+static size_t slot_power_size(const waterfall_t *wf) {
+    return sizeof(float) * wf->params.fftsize * wf->channels * wf->batch;
+}
 
-    uint64_t processed_samples = 0;
-    uint64_t samples_per_frame = params.fftsize - params.overlap;
+static size_t carry_size(const waterfall_t *wf) {
+    return sizeof(fftw_complex) * wf->frame_len * wf->channels;
+}
 
-    start_progress();
+// Work out how the context's buffers are laid out, from the parameters alone.
+static void set_layout(waterfall_t *wf, const waterfall_params_t *params) {
+    wf->params = *params;
+    wf->channels = (params->channels > 0) ? params->channels : 1;
 
-    for (y = 0; y < params.frames; y++) {
-        // read an FFT-worth of complex samples and convert them to doubles
+    uint32_t taps = (params->taps > 1) ? params->taps : 1;
+    wf->frame_len = taps * params->fftsize;
+    wf->carry_len = wf->frame_len - (params->fftsize - params->overlap);
 
-        // if overlap is nonzero, left shift the 'in' array by the overlap
-        // amount first
-        if (params.overlap > 0) {
-            shiftleft(in, params.fftsize, params.overlap);
+    wf->sample_size = format_sample_size(params->format);
+    wf->stride = wf->sample_size * wf->channels;
+    if (params->bandwidth > 0 && params->bandwidth <= 1.0) {
+        wf->ddc_out_len = DDC_BLOCK_SIZE / ddc_decimation(params->bandwidth) + 1;
+    }
+
+    bool threaded = (params->threads > 0) || params->pool;
+    wf->batch = params->rows_per_block;
+    if (wf->batch == 0) {
+        wf->batch = threaded ? DEFAULT_THREADED_BATCH : 1;
+    }
+    if (params->pool) {
+        wf->nworkers = pool_threads(params->pool);
+    } else {
+        wf->nworkers = threaded ? params->threads : 1;
+    }
+    wf->nslots = threaded ? SLOTS_PER_WORKER * wf->nworkers : 1;
+}
+
+size_t waterfall_memory(const waterfall_params_t *params, bool power) {
+    waterfall_t wf;
+    memset(&wf, 0, sizeof(wf));
+    set_layout(&wf, params);
+
+    size_t worker = arena_footprint(wf.frame_len * sizeof(double)) +
+                    2 * arena_footprint(params->fftsize * sizeof(fftw_complex));
+    size_t slot = arena_footprint(slot_frames_size(&wf)) +
+                  arena_footprint(slot_rows_size(&wf));
+    if (power) {
+        slot += arena_footprint(slot_power_size(&wf));
+    }
+    size_t size = (wf.nworkers * worker) + (wf.nslots * slot) +
+                  arena_footprint(carry_size(&wf)) +
+                  arena_footprint(wf.stride);
+    if (params->bandwidth > 0) {
+        size += arena_footprint(sizeof(fftw_complex) * DDC_BLOCK_SIZE) +
+                arena_footprint(sizeof(fftw_complex) * wf.ddc_out_len *
+                                wf.channels);
+    }
+    return size;
+}
+
+static const char *planner_names[] = {"patient", "estimate", "measure",
+                                       "exhaustive"};
+
+static const unsigned planner_flags[] = {FFTW_PATIENT, FFTW_ESTIMATE,
+                                         FFTW_MEASURE, FFTW_EXHAUSTIVE};
+
+int parse_planner(planner_t *planner, const char *name) {
+    for (int i = 0; i <= PLANNER_EXHAUSTIVE; i++) {
+        if (!strcmp(name, planner_names[i])) {
+            *planner = (planner_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *planner_name(planner_t planner) {
+    return planner_names[planner];
+}
+
+// Plan a size, or find the plan made for it earlier with the same effort.
+static fftw_plan get_plan(uint32_t n, planner_t planner) {
+    pthread_mutex_lock(&planner_lock);
+    cached_plan_t *c = plan_cache;
+    while (c && (c->size != n || c->planner != planner)) {
+        c = c->next;
+    }
+    if (!c) {
+        // Plans are executed on the workers' own buffers, so these are only
+        // used for planning.
+        fftw_complex *plan_in =
+            (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * n);
+        fftw_complex *plan_out =
+            (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * n);
+        c = (cached_plan_t *)malloc(sizeof(cached_plan_t));
+        c->size = n;
+        c->planner = planner;
+        c->plan = fftw_plan_dft_1d(n, plan_in, plan_out, FFTW_FORWARD,
+                                   planner_flags[planner]);
+        c->next = plan_cache;
+        plan_cache = c;
+        fftw_free(plan_in);
+        fftw_free(plan_out);
+    }
+    pthread_mutex_unlock(&planner_lock);
+    return c->plan;
+}
+
+// Build a window (or a filterbank's prototype filter, with more than one
+// tap), or find the one built with the same settings earlier. The result is
+// shared, so it must not be destroyed.
+static int get_window(window_t *win, const char *name, uint32_t n,
+                      uint32_t taps, double beta) {
+    int ret = 0;
+    pthread_mutex_lock(&planner_lock);
+    cached_window_t *c = window_cache;
+    while (c && (c->size != n || c->taps != taps || c->beta != beta ||
+                 strcmp(c->name, name))) {
+        c = c->next;
+    }
+    if (!c && strlen(name) < sizeof(c->name)) {
+        c = (cached_window_t *)malloc(sizeof(cached_window_t));
+        int err = (taps > 1) ? make_pfb_window(&c->win, name, n, taps, beta)
+                             : make_window(&c->win, name, n, beta);
+        if (err < 0) {
+            free(c);
+            c = NULL;
+        } else {
+            strcpy(c->name, name);
+            c->size = n;
+            c->taps = taps;
+            c->beta = beta;
+            c->next = window_cache;
+            window_cache = c;
+        }
+    }
+    if (c)
+        *win = c->win;
+    else
+        ret = -1;
+    pthread_mutex_unlock(&planner_lock);
+    return ret;
+}
+
+void waterfall_cleanup(void) {
+    pthread_mutex_lock(&planner_lock);
+    while (plan_cache) {
+        cached_plan_t *next = plan_cache->next;
+        fftw_destroy_plan(plan_cache->plan);
+        free(plan_cache);
+        plan_cache = next;
+    }
+    while (window_cache) {
+        cached_window_t *next = window_cache->next;
+        destroy_window(window_cache->win);
+        free(window_cache);
+        window_cache = next;
+    }
+    pthread_mutex_unlock(&planner_lock);
+}
+
+static void start_frame(waterfall_t *wf) {
+    slot_t *slot = &wf->slots[wf->tail];
+    uint32_t frame_len = wf->frame_len;
+    uint32_t carry_len = wf->carry_len;
+
+    wf->frame = slot->frames + (frame_len * wf->channels * slot->nframes);
+    for (uint32_t c = 0; c < wf->channels; c++) {
+        memcpy(wf->frame + (c * frame_len), wf->carry + (c * carry_len),
+               carry_len * sizeof(fftw_complex));
+    }
+    wf->fill = carry_len;
+}
+
+waterfall_t *waterfall_create(const waterfall_params_t *params,
+                              waterfall_rows_fn rows_fn, void *userdata) {
+    if (params->fftsize == 0 || params->overlap >= params->fftsize) {
+        return NULL;
+    }
+
+    waterfall_t *wf = (waterfall_t *)calloc(1, sizeof(waterfall_t));
+    set_layout(wf, params);
+    wf->rows_fn = rows_fn;
+    wf->userdata = userdata;
+
+    uint32_t taps = (params->taps > 1) ? params->taps : 1;
+    if (get_window(&wf->win, params->window, params->fftsize, taps,
+                   params->beta) < 0) {
+        free(wf);
+        return NULL;
+    }
+
+    if (params->bandwidth > 0) {
+        if (params->bandwidth > 1.0) {
+            free(wf);
+            return NULL;
         }
+        wf->ddc = (ddc_t **)calloc(wf->channels, sizeof(ddc_t *));
+        for (uint32_t c = 0; c < wf->channels; c++) {
+            wf->ddc[c] = ddc_create(params->center, params->bandwidth);
+        }
+        wf->ddc_in = (fftw_complex *)wf_alloc(
+            wf, sizeof(fftw_complex) * DDC_BLOCK_SIZE, -1);
+        wf->ddc_out = (fftw_complex *)wf_alloc(
+            wf, sizeof(fftw_complex) * wf->ddc_out_len * wf->channels, -1);
+    }
 
-        // read in fft size minus overlap, starting at overlap offset into
-        // array
-        params.reader(fp, in + params.overlap, params.fftsize - params.overlap);
+    wf->convert = format_converter(params->format);
+    wf->partial = (uint8_t *)wf_alloc(wf, wf->stride, -1);
 
-        // apply a window we created earlier
-        apply_window(params.win, in, inter);
+    uint32_t n = params->fftsize;
+    wf->plan = get_plan(n, params->planner);
 
-        fftw_execute(p);
+    if (params->pool) {
+        wf->pool = params->pool;
+        wf->placement =
+            (placement_t *)malloc(wf->nworkers * sizeof(placement_t));
+        for (uint32_t i = 0; i < wf->nworkers; i++) {
+            wf->placement[i] = pool_placement(wf->pool, i);
+        }
+    } else {
+        wf->placement =
+            (placement_t *)malloc(wf->nworkers * sizeof(placement_t));
+        plan_placement(wf->placement, wf->nworkers, params->cpus,
+                       params->ncpus, params->numa);
+        // Start the workers before allocating their buffers, so that any
+        // that couldn't be placed get buffers from anywhere too.
+        if (params->threads > 0) {
+            wf->pool =
+                pool_create(wf->nworkers, wf->placement, SLOTS_PER_WORKER);
+            wf->own_pool = true;
+            for (uint32_t i = 0; i < wf->nworkers; i++) {
+                wf->placement[i] = pool_placement(wf->pool, i);
+            }
+        }
+    }
+    wf->workers =
+        (worker_state_t *)calloc(wf->nworkers, sizeof(worker_state_t));
+    for (uint32_t i = 0; i < wf->nworkers; i++) {
+        init_worker(wf, &wf->workers[i], wf->placement[i]);
+    }
+
+    wf->slots = (slot_t *)calloc(wf->nslots, sizeof(slot_t));
+    for (uint32_t i = 0; i < wf->nslots; i++) {
+        slot_t *slot = &wf->slots[i];
+        int node = wf->placement[i % wf->nworkers].node;
+        slot->wf = wf;
+        slot->worker = i % wf->nworkers;
+        slot->frames =
+            (fftw_complex *)wf_alloc(wf, slot_frames_size(wf), node);
+        slot->rows = (uint8_t *)wf_alloc(wf, slot_rows_size(wf), node);
+    }
+    pthread_mutex_init(&wf->lock, NULL);
+    pthread_cond_init(&wf->cond, NULL);
+
+    // The first frame starts out with carry_len's worth of silence.
+    wf->carry = (fftw_complex *)wf_alloc(wf, carry_size(wf), -1);
+    memset(wf->carry, 0, carry_size(wf));
+    start_frame(wf);
+
+    colormap_stats_init(&wf->stats);
+
+    return wf;
+}
+
+void waterfall_destroy(waterfall_t *wf) {
+    if (wf->own_pool) {
+        pool_destroy(wf->pool);
+    }
+
+    for (uint32_t i = 0; i < wf->nslots; i++) {
+        slot_t *slot = &wf->slots[i];
+        int node = wf->placement[i % wf->nworkers].node;
+        wf_free(wf, slot->frames, slot_frames_size(wf), node);
+        wf_free(wf, slot->rows, slot_rows_size(wf), node);
+        if (slot->power) {
+            wf_free(wf, slot->power, slot_power_size(wf), node);
+        }
+    }
+    if (wf->detector) {
+        detector_destroy(wf->detector);
+    }
+    free(wf->slots);
+    for (uint32_t i = 0; i < wf->nworkers; i++) {
+        free_worker(wf, &wf->workers[i]);
+    }
+    free(wf->workers);
+    free(wf->placement);
+    pthread_mutex_destroy(&wf->lock);
+    pthread_cond_destroy(&wf->cond);
+
+    if (wf->ddc) {
+        for (uint32_t c = 0; c < wf->channels; c++) {
+            ddc_destroy(wf->ddc[c]);
+        }
+        free(wf->ddc);
+        wf_free(wf, wf->ddc_in, sizeof(fftw_complex) * DDC_BLOCK_SIZE, -1);
+        wf_free(wf, wf->ddc_out,
+                sizeof(fftw_complex) * wf->ddc_out_len * wf->channels, -1);
+    }
+    wf_free(wf, wf->carry, carry_size(wf), -1);
+    wf_free(wf, wf->partial, wf->stride, -1);
+    free(wf);
+}
+
+// Have every slot keep the power of each bin as well as its colors.
+static void alloc_power(waterfall_t *wf) {
+    for (uint32_t i = 0; i < wf->nslots; i++) {
+        slot_t *slot = &wf->slots[i];
+        int node = wf->placement[i % wf->nworkers].node;
+        if (!slot->power) {
+            slot->power = (float *)wf_alloc(wf, slot_power_size(wf), node);
+        }
+    }
+}
+
+void waterfall_set_detector(waterfall_t *wf, const detect_params_t *params,
+                            detect_event_fn fn, void *userdata) {
+    wf->detector = detector_create(params, wf->params.fftsize, wf->channels,
+                                   fn, userdata, wf->params.arena);
+    if (!wf->resumed) {
+        uint32_t hop = wf->params.fftsize - wf->params.overlap;
+        wf->detect_skip = (wf->carry_len + hop - 1) / hop;
+    }
+    alloc_power(wf);
+}
+
+void waterfall_set_power_fn(waterfall_t *wf, waterfall_power_fn fn,
+                            void *userdata) {
+    wf->power_fn = fn;
+    wf->power_userdata = userdata;
+    alloc_power(wf);
+}
+
+const colormap_stats_t *waterfall_stats(waterfall_t *wf) {
+    colormap_stats_init(&wf->stats);
+    for (uint32_t i = 0; i < wf->nworkers; i++) {
+        colormap_stats_merge(&wf->stats, &wf->workers[i].stats);
+    }
+    return &wf->stats;
+}
+
+void waterfall_get_carry(const waterfall_t *wf, fftw_complex *carry) {
+    memcpy(carry, wf->carry,
+           wf->carry_len * wf->channels * sizeof(fftw_complex));
+}
+
+bool waterfall_resume(waterfall_t *wf, fftw_complex *carry,
+                      const colormap_stats_t *stats) {
+    if (wf->ddc) {
+        return false;
+    }
+    memcpy(wf->carry, carry,
+           wf->carry_len * wf->channels * sizeof(fftw_complex));
+    // The frame in progress already started out with the old carry.
+    start_frame(wf);
+    wf->resumed = true;
+    wf->detect_skip = 0;
+    colormap_stats_merge(&wf->workers[0].stats, stats);
+    return true;
+}
+
+uint32_t waterfall_carry_len(const waterfall_t *wf) {
+    return wf->carry_len;
+}
+
+const placement_t *waterfall_placement(const waterfall_t *wf, uint32_t *n) {
+    *n = wf->pool ? wf->nworkers : 0;
+    return wf->placement;
+}
+
+// Render every frame in a batch. Runs on the slot's worker.
+static void render_slot(void *arg, uint32_t worker) {
+    slot_t *slot = (slot_t *)arg;
+    waterfall_t *wf = slot->wf;
+    worker_state_t *ws = &wf->workers[worker];
+    uint32_t fftsize = wf->params.fftsize;
+    uint32_t half = fftsize / 2;
+    uint32_t x;
+
+    // Channels are laid out one after another in both the frames and the
+    // rows, so each one is just the next transform along.
+    for (uint32_t f = 0; f < slot->nframes * wf->channels; f++) {
+        // apply a window we created earlier (folding the branches of a
+        // filterbank together on the way)
+        fftw_complex *frame = slot->frames + ((size_t)wf->frame_len * f);
+        if (ws->win.size > fftsize)
+            apply_pfb_window(ws->win, fftsize, frame, ws->inter);
+        else
+            apply_window(ws->win, frame, ws->inter);
+
+        fftw_execute_dft(wf->plan, ws->inter, ws->out);
 
         // convert output from doubles to colors
+        uint8_t *row = slot->rows + (3 * fftsize * f);
+
+        // Keep the power of each bin too, in the same order, for the
+        // detector and power callback.
+        float *power = slot->power ? slot->power + ((size_t)fftsize * f) : NULL;
+        double pw;
 
         // first half (negative frequencies)
         for (x = 0; x < half; x++) {
-            render_complex(&(row[x * 3]), out[x + half]);
+            pw = render_complex(&ws->stats, &(row[x * 3]), ws->out[x + half]);
+            if (power)
+                power[x] = (float)pw;
         }
 
         // second half (positive frequencies)
-        for (x = half; x < params.fftsize; x++) {
-            render_complex(&(row[x * 3]), out[x - half]);
+        for (x = half; x < fftsize; x++) {
+            pw = render_complex(&ws->stats, &(row[x * 3]), ws->out[x - half]);
+            if (power)
+                power[x] = (float)pw;
+        }
+    }
+
+    pthread_mutex_lock(&wf->lock);
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&wf->cond);
+    pthread_mutex_unlock(&wf->lock);
+}
+
+// Hand the head slot's rows to the caller once they're rendered, and free the
+// slot up. With wait unset, only delivers if the slot is already done.
+static bool deliver_head(waterfall_t *wf, bool wait) {
+    slot_t *slot = &wf->slots[wf->head];
+
+    pthread_mutex_lock(&wf->lock);
+    while (wait && slot->state != SLOT_DONE) {
+        pthread_cond_wait(&wf->cond, &wf->lock);
+    }
+    bool ready = (slot->state == SLOT_DONE);
+    pthread_mutex_unlock(&wf->lock);
+    if (!ready) {
+        return false;
+    }
+
+    if (wf->detector) {
+        size_t frame_size = (size_t)wf->params.fftsize * wf->channels;
+        for (uint32_t i = 0; i < slot->nframes; i++) {
+            if (slot->y + i >= wf->detect_skip) {
+                detector_process(wf->detector, slot->y + i,
+                                 slot->power + (i * frame_size));
+            }
+        }
+    }
+    if (wf->power_fn) {
+        wf->power_fn(wf->power_userdata, slot->y, slot->nframes, slot->power);
+    }
+    wf->rows_fn(wf->userdata, slot->y, slot->nframes, slot->rows);
+    slot->nframes = 0;
+    slot->state = SLOT_FREE;
+    wf->head = (wf->head + 1) % wf->nslots;
+    wf->inflight--;
+    return true;
+}
+
+// Send the tail slot off to be rendered, and move on to the next one.
+static void submit_tail(waterfall_t *wf) {
+    slot_t *slot = &wf->slots[wf->tail];
+    slot->y = wf->next_y;
+    wf->next_y += slot->nframes;
+    slot->state = SLOT_QUEUED;
+    wf->inflight++;
+    wf->tail = (wf->tail + 1) % wf->nslots;
+
+    if (wf->pool) {
+        pool_submit(wf->pool, slot->worker, render_slot, slot);
+    } else {
+        render_slot(slot, 0);
+    }
+
+    // Pass along whatever is already finished, and make room for the next
+    // batch if the ring is full.
+    while (wf->inflight > 0 && deliver_head(wf, false)) {
+    }
+    if (wf->inflight == wf->nslots) {
+        deliver_head(wf, true);
+    }
+}
+
+// The frame being assembled is full: keep its tail for the next frame, and
+// start on that.
+static void finish_frame(waterfall_t *wf) {
+    uint32_t frame_len = wf->frame_len;
+    uint32_t carry_len = wf->carry_len;
+    slot_t *slot = &wf->slots[wf->tail];
+
+    for (uint32_t c = 0; c < wf->channels; c++) {
+        memcpy(wf->carry + (c * carry_len),
+               wf->frame + (c * frame_len) + (frame_len - carry_len),
+               carry_len * sizeof(fftw_complex));
+    }
+
+    if (++slot->nframes == wf->batch) {
+        submit_tail(wf);
+    }
+    start_frame(wf);
+}
+
+// Append n downconverted samples per channel (each channel's block is
+// ddc_out_len apart in wf->ddc_out) to the frame.
+static void append_samples(waterfall_t *wf, uint32_t n) {
+    uint32_t frame_len = wf->frame_len;
+    uint32_t pos = 0;
+    while (pos < n) {
+        uint32_t take = frame_len - wf->fill;
+        if (take > n - pos) {
+            take = n - pos;
+        }
+        for (uint32_t c = 0; c < wf->channels; c++) {
+            memcpy(wf->frame + (c * frame_len) + wf->fill,
+                   wf->ddc_out + (c * wf->ddc_out_len) + pos,
+                   take * sizeof(fftw_complex));
+        }
+        wf->fill += take;
+        pos += take;
+        if (wf->fill == frame_len) {
+            finish_frame(wf);
+        }
+    }
+}
+
+// Convert n whole raw samples (per channel).
+static void consume_samples(waterfall_t *wf, const uint8_t *raw, uint64_t n) {
+    uint32_t frame_len = wf->frame_len;
+    while (n > 0) {
+        uint32_t take;
+        if (wf->ddc) {
+            take = (n < DDC_BLOCK_SIZE) ? n : DDC_BLOCK_SIZE;
+            uint32_t nout = 0;
+            for (uint32_t c = 0; c < wf->channels; c++) {
+                wf->convert(raw + (c * wf->sample_size), wf->stride,
+                            wf->ddc_in, take);
+                nout = ddc_process(wf->ddc[c], wf->ddc_in, take,
+                                   wf->ddc_out + (c * wf->ddc_out_len));
+            }
+            append_samples(wf, nout);
+        } else {
+            // Convert (and de-interleave) straight into the frame.
+            take = frame_len - wf->fill;
+            if (take > n) {
+                take = n;
+            }
+            for (uint32_t c = 0; c < wf->channels; c++) {
+                wf->convert(raw + (c * wf->sample_size), wf->stride,
+                            wf->frame + (c * frame_len) + wf->fill, take);
+            }
+            wf->fill += take;
+            if (wf->fill == frame_len) {
+                finish_frame(wf);
+            }
+        }
+        raw += take * wf->stride;
+        n -= take;
+    }
+}
+
+// Limit n to what's left before the clip point.
+static uint64_t clip_samples(waterfall_t *wf, uint64_t n) {
+    if (wf->params.clip > 0) {
+        uint64_t left = wf->params.clip - wf->consumed;
+        if (n >= left) {
+            n = left;
+            wf->done = true;
         }
+    }
+    wf->consumed += n;
+    return n;
+}
 
-        png_write_row(png_ptr, row);
+bool waterfall_push(waterfall_t *wf, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    size_t ss = wf->stride;
 
-        update_progress(y, params.frames);
+    if (wf->done) {
+        return false;
+    }
 
-        processed_samples += samples_per_frame;
-        if (params.clip > 0 && processed_samples >= params.clip) {
-            break;
+    // Finish off a sample split across the previous push and this one.
+    if (wf->partial_len > 0) {
+        size_t take = ss - wf->partial_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(wf->partial + wf->partial_len, p, take);
+        wf->partial_len += take;
+        p += take;
+        len -= take;
+        if (wf->partial_len < ss) {
+            return true;
+        }
+        wf->partial_len = 0;
+        consume_samples(wf, wf->partial, clip_samples(wf, 1));
+        if (wf->done) {
+            return false;
         }
     }
 
-    end_progress();
+    uint64_t n = len / ss;
+    consume_samples(wf, p, clip_samples(wf, n));
+    if (wf->done) {
+        return false;
+    }
 
-    fftw_destroy_plan(p);
-    fftw_free(in);
-    fftw_free(inter);
-    fftw_free(out);
+    wf->partial_len = len - (n * ss);
+    memcpy(wf->partial, p + (n * ss), wf->partial_len);
+    return true;
+}
+
+void waterfall_finish(waterfall_t *wf) {
+    if (wf->slots[wf->tail].nframes > 0) {
+        submit_tail(wf);
+    }
+    while (wf->inflight > 0) {
+        deliver_head(wf, true);
+    }
+    if (wf->detector) {
+        detector_finish(wf->detector);
+    }
 }
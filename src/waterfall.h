@@ -1,19 +1,147 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#include <png.h>
-
+#include "affinity.h"
+#include "arena.h"
+#include "colormap.h"
+#include "detect.h"
 #include "formats.h"
-#include "window.h"
+#include "pool.h"
+
+// How hard FFTW looks for a fast plan. Plans are made once per size (and
+// effort) per process, so the default spends a while on it.
+typedef enum {
+    PLANNER_PATIENT = 0,
+    PLANNER_ESTIMATE,
+    PLANNER_MEASURE,
+    PLANNER_EXHAUSTIVE,
+} planner_t;
+
+int parse_planner(planner_t *planner, const char *name);
+const char *planner_name(planner_t planner);
 
 typedef struct {
-    window_t win;
+    format_t format;
+    // Channels interleaved sample by sample in the input (0 or 1 for a single
+    // channel). Channels are rendered side by side in each row.
+    uint32_t channels;
+    // Window function name, as accepted by make_window().
+    const char *window;
+    double beta;
     uint32_t overlap;
     uint32_t fftsize;
-    uint32_t frames;
+    // Polyphase filterbank branches (0 or 1 for a plain windowed FFT). Each
+    // frame then spans taps * fftsize samples, weighted by a prototype filter
+    // shaped by the window, and is folded down to fftsize samples before the
+    // FFT. Frames still advance by fftsize - overlap samples.
+    uint32_t taps;
+    // Stop after this many input samples (0 for no limit).
     uint64_t clip;
-    read_samples_fn reader;
+    // Sub-band zoom, normalized to the input sample rate. A bandwidth of 0
+    // renders the full band.
+    double center;
+    double bandwidth;
+    // Frames rendered as one batch, which is also how rows are delivered to
+    // the callback (0 for every row as soon as it's rendered, or a batch of 16
+    // when threaded).
+    uint32_t rows_per_block;
+    // Effort spent planning the FFT.
+    planner_t planner;
+    // Worker threads for the window/FFT/colormap stages. With 0, everything
+    // runs on the thread calling waterfall_push().
+    uint32_t threads;
+    // CPUs to pin worker threads to, round robin (none to leave them
+    // unpinned).
+    const int *cpus;
+    uint32_t ncpus;
+    // Spread workers over NUMA nodes, and allocate each worker's buffers on
+    // its own node.
+    bool numa;
+    // Render on this pool's workers instead of starting threads of our own,
+    // so that many contexts can share one pool. threads, cpus and numa are
+    // then ignored. The pool must outlive the context.
+    pool_t *pool;
+    // Carve the buffers out of this arena (see waterfall_memory()) instead of
+    // allocating them, so that rendering never allocates. Buffers are then
+    // all on the node that faulted in the arena, whatever numa says. The
+    // arena must outlive the context.
+    arena_t *arena;
 } waterfall_params_t;
 
-void waterfall(png_structp png_ptr, FILE *fp, waterfall_params_t params);
+// Receives nrows consecutive rows, starting at row y, each fftsize * channels
+// RGB pixels wide. The rows are only valid for the duration of the call.
+typedef void (*waterfall_rows_fn)(void *userdata, uint32_t y, uint32_t nrows,
+                                  const uint8_t *rows);
+
+// Receives the power (magnitude squared) of every bin of nrows consecutive
+// rows, starting at row y, in the same order as the pixels of each row. Only
+// valid for the duration of the call.
+typedef void (*waterfall_power_fn)(void *userdata, uint32_t y, uint32_t nrows,
+                                   const float *power);
+
+typedef struct waterfall waterfall_t;
+
+// Returns NULL if the parameters are invalid. Contexts can run concurrently on
+// separate threads. The only state they share is a cache of FFT plans and
+// windows, so that each size is only planned once per process.
+waterfall_t *waterfall_create(const waterfall_params_t *params,
+                              waterfall_rows_fn rows_fn, void *userdata);
+
+// Run an energy detector over the spectrum as it's rendered, reporting events
+// to fn (on the thread calling waterfall_push() or waterfall_finish(), in the
+// order they end). Call before the first push.
+void waterfall_set_detector(waterfall_t *wf, const detect_params_t *params,
+                            detect_event_fn fn, void *userdata);
+
+// Also hand the power of every row to fn, just before its rows go to the rows
+// callback. Call before the first push.
+void waterfall_set_power_fn(waterfall_t *wf, waterfall_power_fn fn,
+                            void *userdata);
+
+// Feed raw samples, in the configured format, to the render. Blocks can be
+// any length and don't need to end on a sample boundary; they are converted
+// directly out of the caller's buffer and not retained. Returns false once
+// the clip limit has been reached and further input will be ignored.
+bool waterfall_push(waterfall_t *wf, const void *buf, size_t len);
+
+// Deliver any rows still buffered for the callback.
+void waterfall_finish(waterfall_t *wf);
+
+void waterfall_destroy(waterfall_t *wf);
+
+// Only meaningful after waterfall_finish().
+const colormap_stats_t *waterfall_stats(waterfall_t *wf);
+
+// The last waterfall_carry_len() samples of each channel, which the next frame
+// starts with. Copies that many values per channel, channel by channel, to
+// carry. After waterfall_finish(), this is the state needed to continue the
+// render later from the sample following the last rendered frame.
+void waterfall_get_carry(const waterfall_t *wf, fftw_complex *carry);
+
+// Samples per channel carried from one frame to the next: overlap, plus
+// (taps - 1) * fftsize with a filterbank.
+uint32_t waterfall_carry_len(const waterfall_t *wf);
+
+// Continue a render saved by an earlier run, from its carry and statistics.
+// Call before the first push. Returns false if the render can't be resumed,
+// which is the case with a sub-band, whose filter state isn't carried over.
+bool waterfall_resume(waterfall_t *wf, fftw_complex *carry,
+                      const colormap_stats_t *stats);
+
+// Release the cached plans and windows. Only call once every context has been
+// destroyed.
+void waterfall_cleanup(void);
+
+// Where the worker threads were placed; sets *n to the number of workers.
+const placement_t *waterfall_placement(const waterfall_t *wf, uint32_t *n);
+
+// Bytes a context with these parameters takes out of its arena, with power
+// set if it will have a detector or power callback. Anything that doesn't fit
+// is allocated as usual.
+size_t waterfall_memory(const waterfall_params_t *params, bool power);
+
+// Number of rows that nsamples input samples (per channel) will render to.
+uint64_t waterfall_rows(const waterfall_params_t *params, uint64_t nsamples);
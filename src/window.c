@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <fftw3.h>
 
@@ -151,6 +152,59 @@ window_t make_window_parzen(uint32_t n) {
     return win;
 }
 
+int make_window(window_t *win, const char *name, uint32_t n, double beta) {
+    if (!strcmp(name, "hann")) {
+        *win = make_window_hann(n);
+    } else if (!strcmp(name, "gaussian")) {
+        *win = make_window_gaussian(n, 8.00);
+    } else if (!strcmp(name, "square")) {
+        *win = make_window_square(n);
+    } else if (!strcmp(name, "blackman")) {
+        *win = make_window_blackman(n);
+    } else if (!strcmp(name, "blackmanharris")) {
+        *win = make_window_blackman_harris(n);
+    } else if (!strcmp(name, "hamming")) {
+        *win = make_window_hamming(n);
+    } else if (!strcmp(name, "kaiser")) {
+        *win = make_window_kaiser(n, beta);
+    } else if (!strcmp(name, "parzen")) {
+        *win = make_window_parzen(n);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int make_pfb_window(window_t *win, const char *name, uint32_t n, uint32_t taps,
+                    double beta) {
+    window_t plain;
+    if (make_window(&plain, name, n, beta) < 0 ||
+        make_window(win, name, taps * n, beta) < 0) {
+        return -1;
+    }
+
+    // A sinc one bin wide, taps bins long, under the window.
+    double center = (win->size - 1) / 2.0;
+    double sum = 0;
+    for (uint32_t k = 0; k < win->size; k++) {
+        double t = (k - center) / n;
+        double sinc = (t == 0) ? 1.0 : sin(M_PI * t) / (M_PI * t);
+        win->coeffs[k] *= sinc;
+        sum += win->coeffs[k];
+    }
+
+    // Match the gain of the plain window, so images come out as bright.
+    double gain = 0;
+    for (uint32_t k = 0; k < n; k++) {
+        gain += plain.coeffs[k];
+    }
+    for (uint32_t k = 0; k < win->size; k++) {
+        win->coeffs[k] *= gain / sum;
+    }
+    destroy_window(plain);
+    return 0;
+}
+
 void destroy_window(window_t win) {
     free(win.coeffs);
 }
@@ -162,3 +216,22 @@ void apply_window(window_t win, fftw_complex *in, fftw_complex *out) {
         out[i][1] = coeffs[i] * in[i][1];
     }
 }
+
+void apply_pfb_window(window_t win, uint32_t n, fftw_complex *in,
+                      fftw_complex *out) {
+    double *coeffs = win.coeffs;
+    for (uint32_t i = 0; i < n; i++) {
+        out[i][0] = coeffs[i] * in[i][0];
+        out[i][1] = coeffs[i] * in[i][1];
+    }
+    // One pass per branch, each a straight run through memory that the
+    // compiler can vectorize like apply_window().
+    for (uint32_t m = n; m < win.size; m += n) {
+        double *c = coeffs + m;
+        fftw_complex *x = in + m;
+        for (uint32_t i = 0; i < n; i++) {
+            out[i][0] += c[i] * x[i][0];
+            out[i][1] += c[i] * x[i][1];
+        }
+    }
+}
@@ -18,6 +18,23 @@ window_t make_window_hamming(uint32_t n);
 window_t make_window_kaiser(uint32_t n, double beta);
 window_t make_window_parzen(uint32_t n);
 
+// Build the window function called name. beta is only used by windows that
+// take a parameter. Returns -1 if the name is unknown.
+int make_window(window_t *win, const char *name, uint32_t n, double beta);
+
+// Build the prototype filter of a polyphase filterbank with taps branches of
+// n: a sinc one bin wide, taps * n samples long, shaped by the window called
+// name. Its gain matches the plain window of size n. Returns -1 if the name is
+// unknown.
+int make_pfb_window(window_t *win, const char *name, uint32_t n, uint32_t taps,
+                    double beta);
+
 void destroy_window(window_t win);
 
 void apply_window(window_t win, fftw_complex *in, fftw_complex *out);
+
+// Weight win.size samples by a prototype filter, and fold the branches down
+// to n samples for an n point FFT: out[i] is the sum of coeffs[i + m * n] *
+// in[i + m * n] over every branch m.
+void apply_pfb_window(window_t win, uint32_t n, fftw_complex *in,
+                      fftw_complex *out);